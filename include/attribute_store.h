@@ -1,21 +1,34 @@
-/*! \file */ 
+/*! \file */
 #ifndef _ATTRIBUTE_STORE_H
 #define _ATTRIBUTE_STORE_H
 
 #include "vector_tile.pb.h"
-#include <unordered_set>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
 #include <boost/container/small_vector.hpp>
 #include <algorithm>
 
-/*	AttributeStore 
+/*	AttributeStore
  *	global dictionaries for attributes
- *	We combine all similair keys/values pairs and sets
- *	- All the same key/value pairs are combined in key_values
- *	- All the same set of key/values are combined in set_list
+ *	We combine all similar keys, values, key/value pairs and sets
+ *	- All the same keys are combined in keys, and all the same values in values
+ *	- All the same key/value pairs (with minimum zoom) are combined in key_values
+ *	- All the same set of key/values are combined in sets
  *
- *	Every key/value set gets an ID in set_list. If the ID of two attribute sets are the same
- *	this means these objects share the same set of attribute/values. Output objects store a 
- *	reference to the set of paremeters in set_list. 
+ *	Each dictionary is a hash table which hands out dense integer IDs, so storing is O(1).
+ *	If the IDs of two attribute sets are the same, this means these objects share the same
+ *	set of attribute/values. Output objects store the ID of their set.
+ *
+ *	Storing is thread-safe, and only locks one shard of a dictionary. Looking up by ID is not
+ *	synchronised, so it must not run concurrently with storing (tiles are only written once all
+ *	objects have been stored).
+ *
+ *	Once storing is done, encodeSets() lists the (key ID, value ID) pairs that each set writes
+ *	at each zoom level, so that writing a feature's attributes is just a loop over integers.
 */
 
 struct AttributeStore
@@ -26,6 +39,25 @@ struct AttributeStore
 		char minzoom;
 	};
 
+	using key_id_t = uint32_t;
+	using value_id_t = uint32_t;
+	using key_value_id_t = uint32_t;
+	using key_value_set_id_t = uint32_t;
+
+	/// An interned key/value pair
+	struct key_value_t {
+		key_id_t key;
+		value_id_t value;
+		char minzoom;
+
+		bool operator==(key_value_t const &other) const {
+			return key == other.key && value == other.value && minzoom == other.minzoom;
+		}
+	};
+
+	/// A set of key/value pairs, sorted by ID
+	using key_value_set_entry_t = boost::container::small_vector<key_value_id_t, 4>;
+
 	enum class Index { BOOL, FLOAT, STRING };
 
 	static Index type_index(vector_tile::Tile_Value const &v)
@@ -38,119 +70,199 @@ struct AttributeStore
 			return Index::BOOL;
 	}
 
-	static bool compare(vector_tile::Tile_Value const &lhs, vector_tile::Tile_Value const &rhs) {
-		auto lhs_id = type_index(lhs);
-		auto rhs_id = type_index(lhs);
-
-		if(lhs_id < rhs_id)
-			return true;
-		if(lhs_id > rhs_id)
-			return false;
-
-		switch(lhs_id) {
-			case Index::BOOL:
-				return lhs.bool_value() < rhs.bool_value();
-			case Index::FLOAT:	
-				return lhs.float_value() < rhs.float_value();
-			case Index::STRING:	
-				return lhs.string_value() < rhs.string_value();
+	struct value_hash {
+		std::size_t operator()(vector_tile::Tile_Value const &v) const;
+	};
+	struct value_equal {
+		bool operator()(vector_tile::Tile_Value const &lhs, vector_tile::Tile_Value const &rhs) const;
+	};
+	struct key_value_hash {
+		std::size_t operator()(key_value_t const &kv) const;
+	};
+	struct key_value_set_hash {
+		std::size_t operator()(key_value_set_entry_t const &set) const;
+	};
+
+	/**
+	 * \brief A thread-safe dictionary giving each distinct item a dense ID, starting from 0
+	 *
+	 * Items are split into shards by hash, each with its own lock. A shard holds each item once,
+	 * in a deque (so it never moves), and indexes it by pointer. IDs are handed out from a shared
+	 * counter, and an ID's item is found through a table of pointers, allocated in chunks as needed.
+	 */
+	template<class T, class Hash, class Equal = std::equal_to<T>>
+	class Dictionary {
+	public:
+		Dictionary() : count(0), chunks(MAX_CHUNKS) {
+			for (auto &chunk : chunks) chunk.store(nullptr);
+		}
+		~Dictionary() {
+			for (auto &chunk : chunks) delete[] chunk.load();
 		}
 
-		throw std::runtime_error("Invalid type in attribute store");
-	}
+		uint32_t store(T const &item) {
+			std::size_t hash = Hash()(item);
+			Shard &shard = shards[((hash * 0x9E3779B97F4A7C15ULL) >> 32) % SHARDS];
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			auto it = shard.ids.find(&item);
+			if (it != shard.ids.end()) return it->second;
+			shard.items.push_back(item);
+			T const *stored = &shard.items.back();
+			uint32_t id = count++;
+			setPointer(id, stored);
+			shard.ids.emplace(stored, id);
+			return id;
+		}
+		T const &at(uint32_t id) const { return *chunks[id >> CHUNK_BITS].load()[id & (CHUNK_SIZE-1)]; }
+		std::size_t size() const { return count.load(); }
 
-    
-    struct key_value_less {
-        bool operator()(kv_with_minzoom const &lhs, kv_with_minzoom const& rhs) const {            
-			return (lhs.minzoom != rhs.minzoom) ? (lhs.minzoom < rhs.minzoom)
-			     : (lhs.key != rhs.key) ? (lhs.key < rhs.key)
-			     : compare(lhs.value, rhs.value);
-        }
-    }; 
-    
-    using key_value_store_t = std::set<kv_with_minzoom, key_value_less>;
-    using key_value_store_iter_t = key_value_store_t::const_iterator;
-    key_value_store_t key_values;
-        
-    struct key_value_store_less {
-        bool operator()(key_value_store_iter_t lhs, key_value_store_iter_t rhs) const {            
-			return (lhs->minzoom != rhs->minzoom) ? (lhs->minzoom < rhs->minzoom)
-			     : (lhs->key != rhs->key) ? (lhs->key < rhs->key)
-			     : compare(lhs->value, rhs->value);
-        }
-    }; 
-    
-	using key_value_set_entry_t = boost::container::small_vector<key_value_store_iter_t, 1>;
-	using key_value_set_id_t = uint32_t;
+	private:
+		static const unsigned SHARDS = 16;
+		static const unsigned CHUNK_BITS = 16;
+		static const uint32_t CHUNK_SIZE = 1u << CHUNK_BITS;
+		static const uint32_t MAX_CHUNKS = 1u << (32 - CHUNK_BITS);
+
+		struct PointerHash {
+			std::size_t operator()(T const *item) const { return Hash()(*item); }
+		};
+		struct PointerEqual {
+			bool operator()(T const *a, T const *b) const { return Equal()(*a, *b); }
+		};
+
+		struct Shard {
+			std::mutex mutex;
+			std::deque<T> items;
+			std::unordered_map<T const *, uint32_t, PointerHash, PointerEqual> ids;
+		};
 
-	struct key_value_set_store_t {
-		key_value_set_id_t id;
-		key_value_set_entry_t entries; 
+		void setPointer(uint32_t id, T const *item) {
+			std::atomic<T const **> &chunk = chunks[id >> CHUNK_BITS];
+			T const **pointers = chunk.load();
+			if (!pointers) {
+				// another thread may allocate this chunk at the same time: keep whichever comes first
+				T const **fresh = new T const *[CHUNK_SIZE];
+				if (chunk.compare_exchange_strong(pointers, fresh)) pointers = fresh;
+				else delete[] fresh;
+			}
+			pointers[id & (CHUNK_SIZE-1)] = item;
+		}
+
+		Shard shards[SHARDS];
+		std::atomic<uint32_t> count;
+		std::vector<std::atomic<T const **>> chunks;	// ID -> item
 	};
 
-    struct key_value_set_store_less {
-        bool operator()(key_value_set_store_t const &lhs, key_value_set_store_t const &rhs) const {  
-            if(lhs.entries.size() < rhs.entries.size()) return true;
-            if(lhs.entries.size() > rhs.entries.size()) return false;
-            
-            key_value_store_less compare;
-            for(auto i = lhs.entries.begin(), j = rhs.entries.begin(); i != lhs.entries.end(); ++i, ++j) {
-                if(compare(*i, *j)) return true;
-                if(compare(*j, *i)) return false;
-            }
-            
-            return false;            
-        }
-    };     
-    
-    using key_value_set_t = std::set<key_value_set_store_t, key_value_set_store_less>;
-	using key_value_set_iter_t = key_value_set_t::const_iterator;
-    key_value_set_t set_list;
-
- 
-    AttributeStore()
-		: empty_set_iter(store_set(key_value_set_entry_t()))
-		, next_set_id(0) 
-    { }
-            
-    key_value_store_iter_t store_key_value(std::string const &key, vector_tile::Tile_Value const &value, char const minZoom) {
-        return key_values.insert({ key, value, minZoom }).first;              
-    }
-    
-    key_value_set_iter_t store_set(key_value_set_entry_t set) {
-        std::sort(set.begin(), set.end(), key_value_store_less());
-        return set_list.insert( {next_set_id++, set} ).first;        
-    }
-    
-	key_value_set_iter_t empty_set() const { return empty_set_iter; }
-
-	/*
-    void print() {
-        std::cout << "Total sets: " << set_list.size() << std::endl;
-        std::cout << "Total keys: " << keys.size() << std::endl;
-        std::cout << "Total values: " << values.size() << std::endl;
-        std::cout << "Total key values: " << key_values.size() << std::endl;
-
-        for(auto const &i: set_list) {
-            std::cout << "Set" << std::endl;
-            for(auto const &j: i) {
-                std::cout << *(j->first) << " ";
-				
-				if(j->second->has_bool_value())
-					std::cout << std::boolalpha << j->second->bool_value() << std::endl;
-				else if(j->second->has_float_value())
-					std::cout << j->second->float_value() << std::endl;
-				else if(j->second->has_string_value())
-					std::cout << j->second->string_value() << std::endl;
-            }
-        } 
-    }  */
+	AttributeStore() {
+		store_set(key_value_set_entry_t());		// the empty set always has ID 0
+	}
+
+	key_value_id_t store_key_value(std::string const &key, vector_tile::Tile_Value const &value, char const minZoom) {
+		return key_values.store({ keys.store(key), values.store(value), minZoom });
+	}
+
+	key_value_set_id_t store_set(key_value_set_entry_t set) {
+		std::sort(set.begin(), set.end());
+		return sets.store(set);
+	}
+
+	key_value_set_id_t empty_set() const { return 0; }
+
+	/// Encode the sets stored since the last call, ready for get_encoded_set (not thread-safe)
+	void encodeSets();
+
+	/// The (key ID, value ID) pairs to write for a set at this zoom level, as alternate entries from first to last
+	std::pair<uint32_t const *, uint32_t const *> get_encoded_set(key_value_set_id_t id, char zoom) const {
+		// each block holds the pairs with at most its minimum zoom: use the last one which applies
+		uint32_t block = encodedSets[id+1];
+		while (block > encodedSets[id] && encodedBlocks[block-1].minzoom > zoom) block--;
+		if (block == encodedSets[id]) return std::make_pair(nullptr, nullptr);
+		encoded_block_t const &b = encodedBlocks[block-1];
+		return std::make_pair(&encodedPairs[b.offset], &encodedPairs[b.offset] + b.size);
+	}
+
+	// ----	Lookups by ID
+
+	key_value_set_entry_t const &get_set(key_value_set_id_t id) const { return sets.at(id); }
+	key_value_t const &get_key_value(key_value_id_t id) const { return key_values.at(id); }
+	std::string const &get_key(key_id_t id) const { return keys.at(id); }
+	vector_tile::Tile_Value const &get_value(value_id_t id) const { return values.at(id); }
+
+	void reportSize() const;
 
 private:
-	key_value_set_iter_t empty_set_iter;
-	key_value_set_id_t next_set_id;
+	struct encoded_block_t {
+		char minzoom;
+		uint32_t offset;			// in encodedPairs
+		uint32_t size;
+	};
+
+	Dictionary<std::string, std::hash<std::string>> keys;
+	Dictionary<vector_tile::Tile_Value, value_hash, value_equal> values;
+	Dictionary<key_value_t, key_value_hash> key_values;
+	Dictionary<key_value_set_entry_t, key_value_set_hash> sets;
+
+	std::vector<uint32_t> encodedSets { 0 };		// set ID -> its first block; the next set's first block ends it
+	std::vector<encoded_block_t> encodedBlocks;		// for each set, in order of minzoom
+	std::vector<uint32_t> encodedPairs;
 };
 
-using AttributeStoreRef = AttributeStore::key_value_set_iter_t;
+using AttributeStoreRef = AttributeStore::key_value_set_id_t;
+
+/**
+ * \brief The keys and values of a layer being written to a tile
+ *
+ * Each key and value (by its ID in the AttributeStore) is given its index in the layer the first
+ * time it's used, and found with a hash lookup after that. When merging with an existing tile,
+ * the layer starts with that tile's keys and values, which are reused if an attribute matches.
+ */
+class LayerDictionary {
+
+public:
+	LayerDictionary(AttributeStore const &attributeStore) : attributeStore(attributeStore) { }
+
+	/// Add a key or value from an existing tile
+	void addExisting(std::string const &key) {
+		existingKeys.emplace(key, keys.size());
+		keys.push_back(key);
+	}
+	void addExisting(vector_tile::Tile_Value const &value) {
+		existingValues.emplace(value, values.size());
+		values.push_back(value);
+	}
+
+	/// The index of a key in this layer, adding it if it's new
+	uint32_t keyIndex(AttributeStore::key_id_t id) {
+		auto it = keyIndices.find(id);
+		if (it != keyIndices.end()) return it->second;
+		std::string const &key = attributeStore.get_key(id);
+		auto existing = existingKeys.find(key);
+		uint32_t index = existing != existingKeys.end() ? existing->second : keys.size();
+		if (index == keys.size()) keys.push_back(key);
+		keyIndices.emplace(id, index);
+		return index;
+	}
+
+	/// The index of a value in this layer, adding it if it's new
+	uint32_t valueIndex(AttributeStore::value_id_t id) {
+		auto it = valueIndices.find(id);
+		if (it != valueIndices.end()) return it->second;
+		vector_tile::Tile_Value const &value = attributeStore.get_value(id);
+		auto existing = existingValues.find(value);
+		uint32_t index = existing != existingValues.end() ? existing->second : values.size();
+		if (index == values.size()) values.push_back(value);
+		valueIndices.emplace(id, index);
+		return index;
+	}
+
+	std::vector<std::string> keys;					// in order of index
+	std::vector<vector_tile::Tile_Value> values;
+
+private:
+	AttributeStore const &attributeStore;
+	std::unordered_map<AttributeStore::key_id_t, uint32_t> keyIndices;
+	std::unordered_map<AttributeStore::value_id_t, uint32_t> valueIndices;
+	std::unordered_map<std::string, uint32_t> existingKeys;
+	std::unordered_map<vector_tile::Tile_Value, uint32_t, AttributeStore::value_hash, AttributeStore::value_equal> existingValues;
+};
 
-#endif //_COORDINATES_H
+#endif //_ATTRIBUTE_STORE_H
@@ -0,0 +1,236 @@
+/*! \file */
+#ifndef _CLIP_H
+#define _CLIP_H
+
+#include <vector>
+#include "geomtypes.h"
+
+/*	Clipping to axis-aligned boxes
+
+	Clipping to a box is a much simpler problem than general polygon overlay, so we do it ourselves:
+	- linestrings are clipped segment by segment (Liang-Barsky)
+	- polygon rings are clipped to each side of the box in turn (Sutherland-Hodgman)
+
+	Sutherland-Hodgman only gives a valid polygon when each ring enters the box at most once: otherwise
+	the separate parts are joined by zero-width slivers along the box edge. In that case (and where
+	holes cross the edge) we fall back to Boost.Geometry's intersection.
+*/
+
+namespace clip {
+
+namespace geom = boost::geometry;
+
+/// Find the part of the segment a-b within the box, as parameters t0<=t1 along it
+inline bool clipSegment(Point const &a, Point const &b, Box const &box, double &t0, double &t1) {
+	double dx = b.x()-a.x(), dy = b.y()-a.y();
+	double p[4] = { -dx, dx, -dy, dy };
+	double q[4] = { a.x()-box.min_corner().x(), box.max_corner().x()-a.x(),
+	                a.y()-box.min_corner().y(), box.max_corner().y()-a.y() };
+	t0 = 0.0; t1 = 1.0;
+	for (int i=0; i<4; i++) {
+		if (p[i]==0) {
+			if (q[i]<0) return false;		// parallel to this side, and outside it
+		} else {
+			double r = q[i] / p[i];
+			if (p[i]<0) {
+				if (r>t1) return false;
+				if (r>t0) t0 = r;
+			} else {
+				if (r<t0) return false;
+				if (r<t1) t1 = r;
+			}
+		}
+	}
+	return true;
+}
+
+inline Point interpolate(Point const &a, Point const &b, double t) {
+	if (t<=0.0) return a;
+	if (t>=1.0) return b;
+	return Point(a.x() + t*(b.x()-a.x()), a.y() + t*(b.y()-a.y()));
+}
+
+inline bool inside(Point const &p, Box const &box) {
+	return p.x()>=box.min_corner().x() && p.x()<=box.max_corner().x() &&
+	       p.y()>=box.min_corner().y() && p.y()<=box.max_corner().y();
+}
+
+/// Clip a linestring to a box, adding the parts within it to out
+template<class LinestringT>
+void clipLinestring(LinestringT const &ls, Box const &box, MultiLinestring &out) {
+	Linestring current;
+	auto flush = [&]() {
+		if (current.size()>1) out.push_back(std::move(current));
+		current.clear();
+	};
+	for (size_t i=1; i<ls.size(); i++) {
+		double t0, t1;
+		if (!clipSegment(ls[i-1], ls[i], box, t0, t1)) { flush(); continue; }
+		if (t0>0.0 || current.empty()) {
+			flush();
+			current.push_back(interpolate(ls[i-1], ls[i], t0));
+		}
+		current.push_back(interpolate(ls[i-1], ls[i], t1));
+		if (t1<1.0) flush();
+	}
+	flush();
+}
+
+/// How a ring relates to a box
+enum class RingPosition { INSIDE, OUTSIDE, CONTAINS_BOX, CROSSES_ONCE, CROSSES_MANY };
+
+/// Find how a (closed) ring relates to a box
+template<class RingT>
+RingPosition ringPosition(RingT const &ring, Box const &box) {
+	unsigned entries = 0;
+	bool allInside = true;
+	for (size_t i=1; i<ring.size(); i++) {
+		double t0, t1;
+		if (!inside(ring[i], box)) allInside = false;
+		// count each time we enter the box from outside (touching counts too, so we never undercount)
+		if (clipSegment(ring[i-1], ring[i], box, t0, t1) && t0>0.0) entries++;
+	}
+	if (allInside) return RingPosition::INSIDE;
+	if (entries>1) return RingPosition::CROSSES_MANY;
+	if (entries==1) return RingPosition::CROSSES_ONCE;
+
+	// the ring doesn't touch the box, so either surrounds it or is separate from it
+	Point centre((box.min_corner().x()+box.max_corner().x())/2, (box.min_corner().y()+box.max_corner().y())/2);
+	return geom::within(centre, ring) ? RingPosition::CONTAINS_BOX : RingPosition::OUTSIDE;
+}
+
+/// Clip a ring to a box (Sutherland-Hodgman), keeping its orientation
+template<class RingT>
+void clipRing(RingT const &ring, Box const &box, Ring &out) {
+	std::vector<Point> current(ring.begin(), ring.end()), next;
+	if (!current.empty()) current.pop_back();			// we work on an open ring
+
+	// clip to each side of the box in turn: side 0-3 is left, right, bottom, top
+	for (int side=0; side<4 && !current.empty(); side++) {
+		auto in = [&](Point const &p) {
+			switch (side) {
+				case 0:  return p.x() >= box.min_corner().x();
+				case 1:  return p.x() <= box.max_corner().x();
+				case 2:  return p.y() >= box.min_corner().y();
+				default: return p.y() <= box.max_corner().y();
+			}
+		};
+		auto crossing = [&](Point const &a, Point const &b) {
+			double t;
+			switch (side) {
+				case 0:  t = (box.min_corner().x()-a.x()) / (b.x()-a.x()); return Point(box.min_corner().x(), a.y() + t*(b.y()-a.y()));
+				case 1:  t = (box.max_corner().x()-a.x()) / (b.x()-a.x()); return Point(box.max_corner().x(), a.y() + t*(b.y()-a.y()));
+				case 2:  t = (box.min_corner().y()-a.y()) / (b.y()-a.y()); return Point(a.x() + t*(b.x()-a.x()), box.min_corner().y());
+				default: t = (box.max_corner().y()-a.y()) / (b.y()-a.y()); return Point(a.x() + t*(b.x()-a.x()), box.max_corner().y());
+			}
+		};
+
+		next.clear();
+		Point prev = current.back();
+		bool prevIn = in(prev);
+		for (auto const &p: current) {
+			bool pIn = in(p);
+			if (pIn != prevIn) next.push_back(crossing(prev, p));
+			if (pIn) next.push_back(p);
+			prev = p; prevIn = pIn;
+		}
+		current.swap(next);
+	}
+
+	// The walk along the box edges from where we leave the box to where we re-enter it
+	// can double back on itself, so remove repeated points and points in the middle of
+	// a straight run along one side
+	auto onSide = [&](Point const &a, Point const &b, Point const &c) {
+		return (a.x()==b.x() && b.x()==c.x() && (b.x()==box.min_corner().x() || b.x()==box.max_corner().x())) ||
+		       (a.y()==b.y() && b.y()==c.y() && (b.y()==box.min_corner().y() || b.y()==box.max_corner().y()));
+	};
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (size_t i=0; i<current.size() && current.size()>=3; ) {
+			Point const &a = current[(i+current.size()-1) % current.size()];
+			Point const &b = current[i];
+			Point const &c = current[(i+1) % current.size()];
+			if ((a.x()==b.x() && a.y()==b.y()) || onSide(a, b, c)) {
+				current.erase(current.begin()+i);
+				changed = true;
+			} else i++;
+		}
+	}
+
+	out.assign(current.begin(), current.end());
+	if (!out.empty()) out.push_back(out.front());
+}
+
+/// The box as a clockwise, closed ring (as used for our polygons)
+inline Ring boxRing(Box const &box) {
+	Ring r;
+	r.push_back(Point(box.min_corner().x(), box.min_corner().y()));
+	r.push_back(Point(box.min_corner().x(), box.max_corner().y()));
+	r.push_back(Point(box.max_corner().x(), box.max_corner().y()));
+	r.push_back(Point(box.max_corner().x(), box.min_corner().y()));
+	r.push_back(Point(box.min_corner().x(), box.min_corner().y()));
+	return r;
+}
+
+/** \brief Clip a polygon to a box, adding the result to out
+ *	Returns false if it needs a general overlay instead (it then adds nothing)
+ */
+template<class PolygonT>
+bool clipPolygon(PolygonT const &poly, Box const &box, MultiPolygon &out) {
+	auto const &outer = geom::exterior_ring(poly);
+	Polygon result;
+	switch (ringPosition(outer, box)) {
+		case RingPosition::OUTSIDE:      return true;
+		case RingPosition::CROSSES_MANY: return false;
+		case RingPosition::INSIDE:       result.outer().assign(outer.begin(), outer.end()); break;
+		case RingPosition::CONTAINS_BOX: result.outer() = boxRing(box); break;
+		case RingPosition::CROSSES_ONCE:
+			clipRing(outer, box, result.outer());
+			if (result.outer().size()<4 || geom::area(result.outer())==0) return true;
+			break;
+	}
+
+	for (auto const &inner: geom::interior_rings(poly)) {
+		switch (ringPosition(inner, box)) {
+			case RingPosition::OUTSIDE:      break;
+			case RingPosition::INSIDE:       result.inners().emplace_back(inner.begin(), inner.end()); break;
+			case RingPosition::CONTAINS_BOX: return true;		// the box is in a hole
+			default:                         return false;		// the hole would touch the edge
+		}
+	}
+	out.push_back(std::move(result));
+	return true;
+}
+
+/// Whether a polygon covers a box, as far as we can tell from how its rings relate to the box
+enum class Coverage { COVERS, DOES_NOT_COVER, UNKNOWN };
+
+/** \brief Find whether a multipolygon covers the whole box, in a single pass over its points
+ *	Returns UNKNOWN if a ring crosses or lies in the box, when it needs a full test (geom::covered_by)
+ */
+template<class MultiPolygonT>
+Coverage coversBox(MultiPolygonT const &mp, Box const &box) {
+	bool unknown = false;
+	for (auto const &poly: mp) {
+		switch (ringPosition(geom::exterior_ring(poly), box)) {
+			case RingPosition::OUTSIDE:      continue;
+			case RingPosition::CONTAINS_BOX: break;
+			default:                         unknown = true; continue;
+		}
+		bool holes = false;
+		for (auto const &inner: geom::interior_rings(poly)) {
+			switch (ringPosition(inner, box)) {
+				case RingPosition::OUTSIDE:      break;
+				case RingPosition::CONTAINS_BOX: holes = true; break;	// the box is in a hole (but may be on an island in it)
+				default:                         holes = true; unknown = true; break;
+			}
+		}
+		if (!holes) return Coverage::COVERS;
+	}
+	return unknown ? Coverage::UNKNOWN : Coverage::DOES_NOT_COVER;
+}
+
+} // namespace clip
+
+#endif //_CLIP_H
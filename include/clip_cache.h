@@ -0,0 +1,130 @@
+/*! \file */
+#ifndef _CLIP_CACHE_H
+#define _CLIP_CACHE_H
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <tuple>
+#include "geomtypes.h"
+#include "coordinates.h"
+#include "osm_store.h"
+
+/** \brief Cache of large geometries already clipped to a tile
+*
+* A tile's clipping box (including its buffer) lies within its parent tile's clipping box, so
+* a child tile can be clipped from the parent's result - typically a small fraction of the
+* full geometry - rather than from the original. Results are keyed by (geometry handle, zoom,
+* tile), and we look for the nearest ancestor which has been clipped.
+*
+* Only geometries with at least MIN_POINTS points are cached. Each cache holds a bounded number
+* of points, dropping the oldest entries first. It is split into shards by handle, so that
+* threads working on different geometries rarely wait for each other.
+*/
+class ClipCache {
+
+public:
+	/// Geometries with fewer points than this are quicker to clip from scratch
+	static const size_t MIN_POINTS = 500;
+
+	/// Don't cache results at maxZoom or above (nothing clips from them), and hold up to maxPoints points of each geometry type
+	ClipCache(uint maxZoom, size_t maxPoints = 8*1024*1024) : polygons(maxPoints), linestrings(maxPoints), maxZoom(maxZoom) { }
+
+	/// Find the clipped geometry for the nearest ancestor of this tile, if there is one
+	bool find(OSMStore::handle_t handle, TileBbox const &bbox, std::shared_ptr<const MultiPolygon> &out) { return polygons.find(handle, bbox, out); }
+	bool find(OSMStore::handle_t handle, TileBbox const &bbox, std::shared_ptr<const MultiLinestring> &out) { return linestrings.find(handle, bbox, out); }
+
+	/// Remember the geometry clipped to this tile
+	void add(OSMStore::handle_t handle, TileBbox const &bbox, MultiPolygon const &geometry) {
+		if (bbox.zoom >= maxZoom) return;
+		size_t points = 0;
+		for (auto const &poly: geometry) {
+			points += poly.outer().size();
+			for (auto const &inner: poly.inners()) points += inner.size();
+		}
+		polygons.add(handle, bbox, geometry, points);
+	}
+	void add(OSMStore::handle_t handle, TileBbox const &bbox, MultiLinestring const &geometry) {
+		if (bbox.zoom >= maxZoom) return;
+		size_t points = 0;
+		for (auto const &ls: geometry) points += ls.size();
+		linestrings.add(handle, bbox, geometry, points);
+	}
+
+	/// Forget everything (e.g. when the geometry store is refilled)
+	void clear() {
+		polygons.clear();
+		linestrings.clear();
+	}
+
+private:
+	typedef std::tuple<OSMStore::handle_t, uint, TileCoordinate, TileCoordinate> Key;
+	static const unsigned SHARDS = 16;
+
+	template <class T>
+	class Store {
+
+	public:
+		Store(size_t maxPoints) : maxPoints(maxPoints / SHARDS) { }
+
+		bool find(OSMStore::handle_t handle, TileBbox const &bbox, std::shared_ptr<const T> &out) {
+			Shard &shard = shardFor(handle);
+			std::lock_guard<std::mutex> lock(shard.m);
+			if (shard.entries.empty()) return false;
+			TileCoordinate x = bbox.index.x, y = bbox.index.y;
+			for (uint zoom = bbox.zoom; zoom-- > 0; ) {
+				x /= 2; y /= 2;
+				auto it = shard.entries.find(Key(handle, zoom, x, y));
+				if (it != shard.entries.end()) { out = it->second; return true; }
+			}
+			return false;
+		}
+
+		void add(OSMStore::handle_t handle, TileBbox const &bbox, T const &geometry, size_t points) {
+			if (points == 0 || points > maxPoints) return;
+			std::shared_ptr<const T> copy = std::make_shared<const T>(geometry);
+			Key key(handle, bbox.zoom, bbox.index.x, bbox.index.y);
+
+			Shard &shard = shardFor(handle);
+			std::lock_guard<std::mutex> lock(shard.m);
+			if (!shard.entries.emplace(key, copy).second) return;
+			shard.order.emplace_back(key, points);
+			shard.points += points;
+			while (shard.points > maxPoints) {
+				shard.entries.erase(shard.order.front().first);
+				shard.points -= shard.order.front().second;
+				shard.order.pop_front();
+			}
+		}
+
+		void clear() {
+			for (auto &shard: shards) {
+				std::lock_guard<std::mutex> lock(shard.m);
+				shard.entries.clear();
+				shard.order.clear();
+				shard.points = 0;
+			}
+		}
+
+	private:
+		struct Shard {
+			std::mutex m;
+			std::map<Key, std::shared_ptr<const T>> entries;
+			std::deque<std::pair<Key, size_t>> order;		// oldest first, with number of points
+			size_t points = 0;
+		};
+
+		// (handles are aligned offsets, so mix the bits before picking a shard)
+		Shard &shardFor(OSMStore::handle_t handle) { return shards[((uint64_t(handle) * 0x9E3779B97F4A7C15ULL) >> 32) % SHARDS]; }
+
+		size_t maxPoints;
+		Shard shards[SHARDS];
+	};
+
+	Store<MultiPolygon> polygons;
+	Store<MultiLinestring> linestrings;
+	uint maxZoom;
+};
+
+#endif //_CLIP_CACHE_H
@@ -76,6 +76,12 @@ double tiley2lat(uint y, uint z);
 // Get a tile index
 TileCoordinates latpLon2index(LatpLon ll, uint baseZoom);
 
+// Z-order (Morton) code of a tile, interleaving the bits of x and y.
+// The descendants of a tile at n zoom levels deeper have the contiguous codes
+// (code << 2n) to ((code+1) << 2n)-1, and the parent of a tile is (code >> 2).
+uint64_t tile2morton(TileCoordinates index);
+TileCoordinates morton2tile(uint64_t code);
+
 // Earth's (mean) radius
 // http://nssdc.gsfc.nasa.gov/planetary/factsheet/earthfact.html
 // http://mathworks.com/help/map/ref/earthradius.html
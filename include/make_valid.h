@@ -0,0 +1,28 @@
+/*! \file */
+#ifndef _MAKE_VALID_H
+#define _MAKE_VALID_H
+
+#include "geomtypes.h"
+#include <vector>
+
+/** \brief Repair a multipolygon when it is read, so that tiles can rely on it being valid
+ *
+ * Closes rings, fixes their winding, removes repeated points and spikes, splits rings which
+ * cross or touch themselves into simple rings, and merges parts which overlap each other.
+ * Polygons and holes which collapse to nothing are removed.
+ *
+ * Returns true if the result is valid. (Valid input costs one is_valid check.)
+ */
+bool makeValid(MultiPolygon &mp);
+
+/** \brief Merge polygons with a cascaded union: union them in pairs, then pairs of those results,
+ * and so on, so that each overlay is between geometries of a similar size
+ *
+ * The parts are used up. If an overlay fails on invalid input, those two are kept side by side.
+ */
+void cascadedUnion(std::vector<MultiPolygon> &parts, MultiPolygon &output);
+
+/// Remove repeated points from a linestring. Returns false if it has fewer than two points left.
+bool makeValid(Linestring &ls);
+
+#endif //_MAKE_VALID_H
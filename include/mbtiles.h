@@ -5,23 +5,49 @@
 #include <string>
 #include <mutex>
 #include <vector>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <memory>
 #include "sqlite_modern_cpp.h"
 
 /** \brief Write to MBTiles (sqlite) database
 *
+* Tiles are written by a dedicated writer thread: saveTile() only queues the tile (waiting
+* if the queue is full), and the writer inserts queued tiles in batches, one transaction each.
+* The fast bulk layout writes tiles without an index, and builds the index when closing.
+* The deduplicated layout stores each distinct tile once in an images table, with a map
+* table of tile coordinates and a tiles view over the two.
+*
 * (note that sqlite_modern_cpp.h is very slightly changed from the original, for blob support and an .init method)
 */
 class MBTiles { 
+	struct PendingTile {
+		int zoom, x, y;
+		std::string data;
+	};
+
 	sqlite::database db;
-	std::mutex m;
-	bool inTransaction;
+	std::mutex m;								// held while using db
+
+	std::unique_ptr<sqlite::database_binder> insertTile, insertImage;
+	std::deque<PendingTile> queue;				// tiles waiting for the writer thread
+	std::mutex queueMutex;
+	std::condition_variable queueNotFull, queueNotEmpty;
+	size_t batchSize;							// tiles written in each transaction
+	bool deduplicate;							// using the map/images layout
+	bool closing;
+	std::thread writer;
+
+	void writeTiles();
+	void stopWriter();
 
 public:
 	MBTiles();
 	virtual ~MBTiles();
-	void openForWriting(std::string *filename);
+	void openForWriting(std::string *filename, size_t batchSize = 1000, bool fastBulk = false, bool deduplicate = false);
 	void writeMetadata(std::string key, std::string value);
-	void saveTile(int zoom, int x, int y, std::string *data);
+	void saveTile(int zoom, int x, int y, std::string data);
 	void closeForWriting();
 
 	void openForReading(std::string *filename);
@@ -0,0 +1,113 @@
+/*! \file */
+#ifndef _MVT_WRITER_H
+#define _MVT_WRITER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "vector_tile.pb.h"
+
+/*	Writing vector tiles
+
+	Tiles are written straight to protobuf wire format, rather than building a vector_tile::Tile
+	and serialising it. Fields are written in field number order, as protobuf does, so the output
+	is identical. Each thread keeps one MvtWriter, so its buffers are reused from tile to tile.
+*/
+
+namespace mvt {
+
+inline void writeVarint(std::string &out, uint64_t value) {
+	while (value >= 0x80) {
+		out.push_back(char((value & 0x7F) | 0x80));
+		value >>= 7;
+	}
+	out.push_back(char(value));
+}
+
+inline void writeKey(std::string &out, uint32_t field, uint32_t wireType) {
+	writeVarint(out, (field << 3) | wireType);
+}
+
+/// Write a length-delimited field
+inline void writeBytes(std::string &out, uint32_t field, std::string const &bytes) {
+	writeKey(out, field, 2);
+	writeVarint(out, bytes.size());
+	out.append(bytes);
+}
+
+} // namespace mvt
+
+/** \brief A feature being written: its geometry and tags are packed as they're added
+*
+* Clear and reuse it for each feature, to keep the memory.
+*/
+class MvtFeature {
+
+public:
+	MvtFeature() : id(0), hasId(false), hasType(false), type(vector_tile::Tile_GeomType_UNKNOWN) { }
+
+	void clear() {
+		geometry.clear();
+		tags.clear();
+		hasId = false;
+		hasType = false;
+	}
+
+	void addGeometry(uint32_t value) { mvt::writeVarint(geometry, value); }
+	void addTag(uint32_t index) { mvt::writeVarint(tags, index); }
+	void setType(vector_tile::Tile_GeomType t) { type = t; hasType = true; }
+	void setId(uint64_t i) { id = i; hasId = true; }
+	bool empty() const { return geometry.empty(); }
+
+	std::string geometry;		// packed varints
+	std::string tags;			// packed varints
+	uint64_t id;
+	bool hasId;
+	bool hasType;
+	vector_tile::Tile_GeomType type;
+};
+
+/** \brief Writes a tile, one layer at a time
+*
+* For each layer: startLayer(), addFeature() for each feature, then endLayer() with the
+* layer's keys and values. Layers without features aren't written.
+*/
+class MvtWriter {
+
+public:
+	MvtWriter() : features(0) { }
+
+	/// Start a new tile
+	void clear() { tile.clear(); }
+
+	void startLayer() {
+		layer.clear();
+		features = 0;
+	}
+
+	void addFeature(MvtFeature const &feature);
+
+	/// Add a feature already built as a protobuf message (from a tile we're merging with)
+	void addFeature(vector_tile::Tile_Feature const &feature);
+
+	size_t featureCount() const { return features; }
+
+	void endLayer(std::string const &name, uint32_t version, uint32_t extent,
+		std::vector<std::string> const &keys, std::vector<vector_tile::Tile_Value> const &values);
+
+	/// Add a whole layer unchanged (from a tile we're merging with)
+	void addLayer(vector_tile::Tile_Layer const &existing);
+
+	/// The encoded tile
+	std::string const &data() const { return tile; }
+
+private:
+	static void writeValue(std::string &out, vector_tile::Tile_Value const &value);
+
+	std::string tile;			// layers written so far
+	std::string layer;			// features of the current layer
+	std::string scratch;
+	size_t features;
+};
+
+#endif //_MVT_WRITER_H
@@ -0,0 +1,52 @@
+/*! \file */
+#ifndef _OSM_LUA_FFI_H
+#define _OSM_LUA_FFI_H
+
+/*	Lua side of the LuaJIT FFI bindings (see OsmLuaProcessing::registerFFIBindings)
+
+	Called with the OsmLuaProcessing object and a table of the C functions it binds, and defines
+	the ffi_osm table. It's in a header of its own so that test/ffi_bindings_test.cpp can check
+	that it compiles, in builds with or without LuaJIT.
+*/
+const char ffiBindings[] = R"lua(
+	local ffi = require("ffi")
+	local object, fn = ...
+	local find = ffi.cast("const char *(*)(void *, const char *, size_t, size_t *)", fn.find)
+	local holds = ffi.cast("int (*)(void *, const char *, size_t)", fn.holds)
+	local layer_id = ffi.cast("int (*)(void *, const char *)", fn.layer_id)
+	local layer = ffi.cast("int (*)(void *, int, int)", fn.layer)
+	local layer_as_centroid = ffi.cast("int (*)(void *, int)", fn.layer_as_centroid)
+	local attribute_key = ffi.cast("int (*)(void *, const char *)", fn.attribute_key)
+	local attribute = ffi.cast("void (*)(void *, int, const char *, size_t, int)", fn.attribute)
+	local attribute_numeric = ffi.cast("void (*)(void *, int, double, int)", fn.attribute_numeric)
+	local attribute_boolean = ffi.cast("void (*)(void *, int, int, int)", fn.attribute_boolean)
+	local min_zoom = ffi.cast("void (*)(void *, int)", fn.min_zoom)
+	local length = ffi.new("size_t[1]")
+
+	ffi_osm = {
+		Find = function(key)
+			local value = find(object, key, #key, length)
+			if value == nil then return "" end
+			return ffi.string(value, length[0])
+		end,
+		Holds = function(key) return holds(object, key, #key) ~= 0 end,
+		LayerId = function(name)
+			local id = layer_id(object, name)
+			if id < 0 then error("ffi_osm.LayerId(): a layer named as \"" .. name .. "\" doesn't exist.") end
+			return id
+		end,
+		Layer = function(id, area)
+			if layer(object, id, area and 1 or 0) == 0 then error("ffi_osm.Layer() failed") end
+		end,
+		LayerAsCentroid = function(id)
+			if layer_as_centroid(object, id) == 0 then error("ffi_osm.LayerAsCentroid() failed") end
+		end,
+		AttributeKey = function(key) return attribute_key(object, key) end,
+		Attribute = function(key, value, minzoom) attribute(object, key, value, #value, minzoom or 0) end,
+		AttributeNumeric = function(key, value, minzoom) attribute_numeric(object, key, value, minzoom or 0) end,
+		AttributeBoolean = function(key, value, minzoom) attribute_boolean(object, key, value and 1 or 0, minzoom or 0) end,
+		MinZoom = function(z) min_zoom(object, z) end,
+	}
+)lua";
+
+#endif //_OSM_LUA_FFI_H
@@ -6,6 +6,7 @@
 #include <string>
 #include <sstream>
 #include <map>
+#include <unordered_map>
 #include "geomtypes.h"
 #include "osm_store.h"
 #include "shared_data.h"
@@ -30,11 +31,16 @@ extern "C" {
 extern bool verbose;
 
 /**
-	\brief OsmLuaProcessing - converts OSM objects into OutputObjectOsmStore objects.
+	\brief OsmLuaProcessing - converts OSM objects into OutputObject objects.
 	
 	The input objects are generated by PbfReader. The output objects are sent to OsmMemTiles for storage.
 
 	This class provides a consistent interface for Lua scripts to access.
+
+	Each instance owns its own Lua state, so several instances can process objects in parallel
+	(one per worker thread). While processing, an instance only reads from the shared stores:
+	the geometries, attributes and tiles it generates are held back until commit() is called
+	from the reading thread, which writes them to OSMStore, AttributeStore and OsmMemTiles.
 */
 class OsmLuaProcessing : public PbfReaderOutput { 
 
@@ -55,6 +61,10 @@ public:
 	// Has this object been assigned to any layers?
 	bool empty();
 
+	// Write all objects processed since the last commit to the shared stores
+	// (must not run concurrently with any other instance)
+	virtual void commit();
+
 	// Shapefile tag remapping
 	bool canRemapShapefiles();
 	kaguya::LuaTable newTable();
@@ -85,6 +95,17 @@ public:
 	// Get an OSM tag for a given key (or return empty string if none)
 	std::string Find(const std::string& key) const;
 
+	// ----	Allocation-free queries for the LuaJIT FFI bindings
+
+	// Get the value of an OSM tag for a given key, or nullptr if none
+	const std::string *FindValue(const char *key, size_t length) const;
+
+	// Get the number of a layer (or -1 if it doesn't exist)
+	int LayerId(const std::string &layerName) const;
+
+	// Intern an attribute key, returning its number
+	uint AttributeKeyId(const std::string &key);
+
 	// ----	Spatial queries called from Lua
 
 	// Find intersecting shapefile layer
@@ -102,25 +123,11 @@ public:
 
 	// ----	Requests from Lua to write this way/node to a vector tile's Layer
 
-    template<class GeometryT>
-    void CorrectGeometry(GeometryT &geom)
-    {
-        geom::correct(geom); // fix wrong orientation
-#if BOOST_VERSION >= 105800
-        geom::validity_failure_type failure;
-        if (isRelation && !geom::is_valid(geom,failure)) {
-            if (verbose) std::cout << "Relation " << originalOsmID << " has " << boost_validity_error(failure) << std::endl;
-            if (failure==10) return; // too few points
-        } else if (isWay && !geom::is_valid(geom,failure)) {
-            if (verbose) std::cout << "Way " << originalOsmID << " has " << boost_validity_error(failure) << std::endl;
-            if (failure==10) return; // too few points
-        }
-#endif
-    }
-
 	// Add layer
 	void Layer(const std::string &layerName, bool area);
 	void LayerAsCentroid(const std::string &layerName);
+	void LayerWithId(uint layer, bool area);
+	void LayerAsCentroidWithId(uint layer);
 	
 	// Set attributes in a vector tile's Attributes table
 	void Attribute(const std::string &key, const std::string &val);
@@ -129,6 +136,7 @@ public:
 	void AttributeNumericWithMinZoom(const std::string &key, const float val, const char minzoom);
 	void AttributeBoolean(const std::string &key, const bool val);
 	void AttributeBooleanWithMinZoom(const std::string &key, const bool val, const char minzoom);
+	void AttributeWithKeyId(uint keyId, vector_tile::Tile_Value const &value, const char minzoom);
 	void MinZoom(const unsigned z);
 
 	// ----	vector_layers metadata entry
@@ -136,6 +144,7 @@ public:
 	void setVectorLayerMetadata(const uint_least8_t layer, const std::string &key, const uint type);
 
 	std::vector<std::string> GetSignificantNodeKeys();
+	std::vector<std::string> GetSignificantWayKeys();
 
 	// ---- Cached geometries creation
 
@@ -149,13 +158,61 @@ public:
 
 	void setIndexStore(OSMStore const *indexStore) { this->indexStore = indexStore; }
 private:
+	/// An output requested from Lua by Layer()/LayerAsCentroid(), with its geometry and attributes
+	struct PendingOutput {
+		OutputGeometryType geomType;
+		uint_least8_t layer;
+		unsigned minZoom;
+		Geometry geometry;
+		std::vector<AttributeStore::kv_with_minzoom> attributes;
+		bool validGeometry;							///< repaired (if need be) and checked by makeValid
+	};
+
+	/// An object assigned to layers by Lua, waiting for commit()
+	struct PendingObject {
+		NodeID osmID;								///< 0 for relations, which are given an ID when committed
+		bool isRelation;
+		std::vector<TileCoordinates> tiles;			///< tiles the object passes through
+		std::vector<TileCoordinates> polygonTiles;	///< tiles covered by polygon outputs (if different)
+		std::vector<PendingOutput> outputs;
+	};
+
+	/// A call from Lua which changes the outputs, recorded so it can be replayed for identical tags
+	struct LuaCall {
+		enum class Type { LAYER, LAYER_AS_CENTROID, ATTRIBUTE, MIN_ZOOM } type;
+		std::string name;						///< layer name, or attribute key
+		bool area;
+		vector_tile::Tile_Value value;
+		char minzoom;
+	};
+
+	/// Result cache key: object type ('n'ode, 'w'ay or 'r'elation) and its tags
+	using result_cache_key_t = std::pair<char, tag_map_t>;
+	struct ResultCacheHash {
+		std::size_t operator()(result_cache_key_t const &key) const;
+	};
+
 	/// Internal: clear current cached state
-	inline void reset() {
-		outputs.clear();
-		linestringInited = false;
-		polygonInited = false;
-		multiPolygonInited = false;
-	}
+	void reset();
+
+#ifdef LUAJIT
+	/// Internal: define the ffi_osm table of FFI bindings in our Lua state
+	void registerFFIBindings();
+#endif
+
+	/// Internal: call a Lua function for the current object, or replay the calls
+	/// it made for an earlier object with the same tags
+	void callLuaFunction(const char *functionName);
+
+	/// Internal: queue the current object's outputs for commit()
+	void addPending(std::vector<TileCoordinates> &&tiles, std::vector<TileCoordinates> &&polygonTiles);
+
+	/// Internal: add an output for the current object in this layer (nothing if its geometry can't be used)
+	void addLayerOutput(uint layer, bool area);
+	void addCentroidOutput(uint layer);
+
+	/// Internal: add an attribute to the most recent output
+	void addAttribute(const std::string &key, vector_tile::Tile_Value const &value, const char minzoom);
 
 	// Internal: set start/end co-ordinates
 	inline void setLocation(int32_t a, int32_t b, int32_t c, int32_t d) {
@@ -173,7 +230,7 @@ private:
 
 	uint64_t osmID;							///< ID of OSM object (relations have decrementing way IDs)
 	int64_t originalOsmID;					///< Original OSM object ID
-	WayID newWayID = MAX_WAY_ID;			///< Decrementing new ID for relations
+	static WayID newWayID;					///< Decrementing new ID for relations (shared, only used by commit)
 	bool isWay, isRelation, isClosed;		///< Way, node, relation?
 
 	int32_t lon1,latp1,lon2,latp2;			///< Start/end co-ordinates of OSM object
@@ -190,9 +247,19 @@ private:
 	const class Config &config;
 	class LayerDefinition &layers;
 	
-	std::deque<std::pair<OutputObjectRef, AttributeStore::key_value_set_entry_t> > outputs;			///< All output objects that have been created
+	std::vector<PendingOutput> outputs;		///< All outputs that have been created for the current object
+	std::deque<PendingObject> pending;		///< Objects waiting for commit()
 	boost::container::flat_map<std::string, std::string> currentTags;
 
+	bool cacheResults;						///< profile says its functions only depend on tags
+	bool recording;							///< recording Lua calls for the result cache
+	mutable bool cacheable;					///< current object's result only depends on its tags
+	std::vector<LuaCall> calls;				///< Lua calls recorded for the current object
+	std::unordered_map<result_cache_key_t, std::vector<LuaCall>, ResultCacheHash> resultCache;
+
+	std::vector<std::string> attributeKeys;					///< attribute keys interned by AttributeKeyId
+	std::unordered_map<std::string, uint> attributeKeyIds;
+
 };
 
 #endif //_OSM_LUA_PROCESSING_H
@@ -10,13 +10,15 @@
 #include "coordinates.h"
 #include "attribute_store.h"
 #include "osm_store.h"
+#include "clip_cache.h"
+#include "simplify_cache.h"
+#include "simplify.h"
+#include "mvt_writer.h"
 
 // Protobuf
 #include "osmformat.pb.h"
 #include "vector_tile.pb.h"
 
-#include <boost/intrusive_ptr.hpp>
-#include <atomic>
 
 enum class OutputGeometryType : uint8_t { POINT, LINESTRING, POLYGON };
 
@@ -25,102 +27,75 @@ std::ostream& operator<<(std::ostream& os, OutputGeometryType geomType);
 
 /**
  * \brief OutputObject - any object (node, linestring, polygon) to be outputted to tiles
-
- * Possible future improvements to save memory:
- * - use a global dictionary for attribute key/values
+ *
+ * OutputObjects are small plain structs (24 bytes) which live for the whole run:
+ * they are stored by value in their TileDataSource and referred to by OutputObjectRef.
 */
 class OutputObject { 
 
-protected:	
+public:
 	OutputObject(OutputGeometryType type, bool shp, uint_least8_t l, NodeID id, OSMStore::handle_t handle, AttributeStoreRef attributes) 
-		: objectID(id), handle(handle), geomType(type), fromShapefile(shp), layer(l), minZoom(0), references(0), attributes(attributes)
+		: objectID(id), handle(handle), attributes(attributes), geomType(type), layer(l), fromShapefile(shp), minZoom(0), validGeometry(false)
 	{ }
 
-
-public:
 	NodeID objectID;									// id of way (linestring/polygon) or node (point)
 	OSMStore::handle_t handle;							// Handle within global store of geometries
+	AttributeStoreRef attributes;						// ID of attribute set in AttributeStore
 
 	OutputGeometryType geomType : 8;					// point, linestring, polygon...
 	uint_least8_t layer 		: 8;					// what layer is it in?
 	bool fromShapefile 			: 1;
 	unsigned minZoom 			: 4;
-	
-	mutable std::atomic<uint32_t> references;
-
-	AttributeStoreRef attributes;
+	bool validGeometry			: 1;					// checked (and repaired) when read, so overlay operations can be trusted
 
 	void setMinZoom(unsigned z) {
 		minZoom = z;
 	}
 
+	void setValidGeometry(bool valid) {
+		validGeometry = valid;
+	}
+
 	void setAttributeSet(AttributeStoreRef attributes) {
 		this->attributes = attributes;
 	}
 
 	//\brief Write attribute key/value pairs (dictionary-encoded)
-	void writeAttributes(std::vector<std::string> *keyList, 
-		std::vector<vector_tile::Tile_Value> *valueList, vector_tile::Tile_Feature *featurePtr, char zoom) const;
-	
-	/**
-	 * \brief Find a value in the value dictionary
-	 * (we can't easily use find() because of the different value-type encoding - 
-	 *	should be possible to improve this though)
-	 */
-	int findValue(std::vector<vector_tile::Tile_Value> *valueList, vector_tile::Tile_Value const &value) const;
+	void writeAttributes(AttributeStore const &attributeStore, LayerDictionary &dictionary, MvtFeature *featurePtr, char zoom) const;
 };
 
 /**
- * \brief An OutputObject derived class that contains data originally from OsmMemTiles
-*/
-class OutputObjectOsmStorePoint : public OutputObject
-{
-public:
-	OutputObjectOsmStorePoint(OutputGeometryType type, bool shp, uint_least8_t l, NodeID id, OSMStore::handle_t handle, AttributeStoreRef attributes)
-		: OutputObject(type, shp, l, id, handle, attributes)
-	{ 
-		assert(type == OutputGeometryType::POINT);
-	}
-}; 
-
-class OutputObjectOsmStoreLinestring : public OutputObject
-{
-public:
-	OutputObjectOsmStoreLinestring(OutputGeometryType type, bool shp, uint_least8_t l, NodeID id, OSMStore::handle_t handle, AttributeStoreRef attributes)
-		: OutputObject(type, shp, l, id, handle, attributes)
-	{ 
-		assert(type == OutputGeometryType::LINESTRING);
-	}
-};
+ * \brief Reference to an OutputObject stored in a TileDataSource
+ * (objects are never freed before the end of the run, so this is just a plain pointer)
+ */
+class OutputObjectRef {
 
-class OutputObjectOsmStoreMultiPolygon : public OutputObject
-{
 public:
-	OutputObjectOsmStoreMultiPolygon(OutputGeometryType type, bool shp, uint_least8_t l, NodeID id, OSMStore::handle_t handle, AttributeStoreRef attributes)
-		: OutputObject(type, shp, l, id, handle, attributes)
-	{ 
-		assert(type == OutputGeometryType::POLYGON);
-	}
-};
+	OutputObjectRef(OutputObject *oo = nullptr) : oo(oo) { }
 
-typedef boost::intrusive_ptr<OutputObject> OutputObjectRef;
+	OutputObject &operator*() const { return *oo; }
+	OutputObject *operator->() const { return oo; }
+	explicit operator bool() const { return oo != nullptr; }
+	void reset() { oo = nullptr; }
 
-static inline void intrusive_ptr_add_ref(OutputObject *oo){
-	auto result = oo->references.fetch_add(1, std::memory_order_relaxed);
-}
-
-static inline void intrusive_ptr_release(OutputObject *oo) {
-	if (oo->references.fetch_sub(1, std::memory_order_release) == 1) {
-      std::atomic_thread_fence(std::memory_order_acquire);
-      delete oo;
-    }
-}
+private:
+	OutputObject *oo;
+};
 
 /** \brief Assemble a linestring or polygon into a Boost geometry, and clip to bounding box
  * Returns a boost::variant -
  *	 POLYGON->MultiPolygon, CENTROID->Point, LINESTRING->MultiLinestring
+ * Large geometries are clipped from (and added to) clipCache, if given
+ */
+Geometry buildWayGeometry(OSMStore &osmStore, OutputObject const &oo, const TileBbox &bbox, ClipCache *clipCache = nullptr);
+
+/** \brief As buildWayGeometry, but a geometry larger than the tile is simplified before clipping
+ * The simplified geometry is shared between all tiles at this zoom through simplifyCache.
+ * If simplifyLength is set, the level is worked out from it at the latitude of the geometry's centre.
+ * Sets simplified if so; otherwise the result is unsimplified, as from buildWayGeometry.
  */
-Geometry buildWayGeometry(OSMStore &osmStore, OutputObject const &oo, const TileBbox &bbox);
+Geometry buildSimplifiedWayGeometry(OSMStore &osmStore, OutputObject const &oo, const TileBbox &bbox,
+	double simplifyLevel, double simplifyLength, SimplifyAlgorithm simplifyAlgorithm, SimplifyCache &simplifyCache, ClipCache *clipCache, bool &simplified);
 
 //\brief Build a node geometry
 LatpLon buildNodeGeometry(OSMStore &osmStore, OutputObject const &oo, const TileBbox &bbox);
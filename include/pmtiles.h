@@ -0,0 +1,73 @@
+/*! \file */
+#ifndef _PMTILES_H
+#define _PMTILES_H
+
+#include <string>
+#include <mutex>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include <unordered_map>
+
+/** \brief Write to a PMTiles (version 3) archive
+*
+* Tiles are appended to a temporary file as they arrive, with identical tiles stored only once.
+* When closing, the tile data is copied into the archive in tile ID (Hilbert curve) order, so
+* that the archive is clustered, and the directories are built and written.
+*
+* The archive is laid out as: header and root directory (padded to 16k), tile data, metadata,
+* leaf directories.
+*/
+class PMTiles {
+
+public:
+	/// Description of the tileset, written into the header and metadata when closing
+	struct TilesetInfo {
+		uint8_t minZoom, maxZoom, centerZoom;
+		double minLon, minLat, maxLon, maxLat, centerLon, centerLat;
+		uint8_t tileCompression;			// PMTiles compression type: 0 unknown, 1 none, 2 gzip
+		std::string metadata;				// JSON
+	};
+
+	PMTiles();
+	virtual ~PMTiles();
+	void openForWriting(std::string *filename);
+	void saveTile(int zoom, int x, int y, std::string data);
+	void closeForWriting(TilesetInfo const &info);
+
+	/// Tile ID: the tile's position along a Hilbert curve, after all the tiles at lower zooms
+	static uint64_t zxyToTileID(uint8_t zoom, uint32_t x, uint32_t y);
+
+private:
+	struct Entry {
+		uint64_t tileID;
+		uint64_t offset;
+		uint32_t length;
+		uint32_t runLength;					// number of consecutive tile IDs with these contents (0 for a leaf directory)
+	};
+
+	/// Identifies tile contents: two independent hashes and the length
+	struct ContentKey {
+		uint64_t hash;
+		uint32_t crc;
+		uint32_t length;
+		bool operator==(ContentKey const &other) const { return hash==other.hash && crc==other.crc && length==other.length; }
+	};
+	struct ContentKeyHash {
+		std::size_t operator()(ContentKey const &key) const { return key.hash; }
+	};
+
+	static std::string serializeDirectory(std::vector<Entry>::const_iterator begin, std::vector<Entry>::const_iterator end);
+	static std::string serializeHeader(TilesetInfo const &info, uint64_t rootOffset, uint64_t rootLength,
+		uint64_t metadataOffset, uint64_t metadataLength, uint64_t leafOffset, uint64_t leafLength,
+		uint64_t dataOffset, uint64_t dataLength, uint64_t addressedTiles, uint64_t tileEntries, uint64_t tileContents);
+
+	std::string filename, tempFilename;
+	std::fstream tempFile;				// tile data in the order it arrived
+	uint64_t tempLength;
+	std::mutex m;						// held while writing to tempFile
+	std::vector<Entry> entries;			// offsets within tempFile
+	std::unordered_map<ContentKey, std::pair<uint64_t,uint32_t>, ContentKeyHash> contents;
+};
+
+#endif //_PMTILES_H
@@ -6,6 +6,9 @@
 #include <unordered_set>
 #include <vector>
 #include <map>
+#include <set>
+#include <memory>
+#include <functional>
 #include "osm_store.h"
 
 // Protobuf
@@ -13,6 +16,7 @@
 #include "vector_tile.pb.h"
 
 #include <boost/container/flat_map.hpp>
+#include <boost/asio/thread_pool.hpp>
 
 
 ///\brief Specifies callbacks used while loading data using PbfReader
@@ -33,6 +37,9 @@ public:
 	 * we use decrementing positive IDs to give a bit more space for way IDs)
 	 */
 	virtual void setRelation(int64_t relationId, OSMStore::handle_t relationHandle, const tag_map_t &tags) {};
+
+	///\brief Write everything processed since the last commit (called from a single thread)
+	virtual void commit() {};
 };
 
 ///\brief Class to write data to an index file
@@ -57,24 +64,53 @@ private:
 /**
  *\brief Reads a PBF OSM file and returns objects as a stream of events to a class derived from PbfReaderOutput
  *
- * The output class is typically OsmMemTiles, which is derived from PbfReaderOutput
+ * The output class is typically OsmLuaProcessing, which is derived from PbfReaderOutput.
+ * Each primitive group is stored in the OSMStore first, then its objects are split into
+ * contiguous chunks, one per output, and processed in parallel. The outputs are then
+ * committed in order, so the result doesn't depend on the number of outputs.
  */
 class PbfReader
 {
 public:
 	PbfReader(OSMStore &osmStore);
 
-	int ReadPbfFile(std::istream &inputFile, std::unordered_set<std::string> &nodeKeys);
+	/// Read a PBF file. Ways and relations are only sent to the outputs if they have one of
+	/// wayKeys (either "key" or "key=value"), or if wayKeys is empty.
+	int ReadPbfFile(std::istream &inputFile, std::unordered_set<std::string> &nodeKeys, std::unordered_set<std::string> const &wayKeys);
+
+	/// Call process(output, i) for each i in [0, count), splitting the range across the outputs, then commit them in order
+	void ProcessEntries(std::size_t count, std::function<void(PbfReaderOutput &, std::size_t)> const &process);
 
-	///Pointer to output object. Loaded objects are sent here.
-	PbfReaderOutput * output;
+	///Output objects, one per thread. Loaded objects are sent here.
+	std::vector<PbfReaderOutput *> outputs;
 
 private:
+	/// Positions in a block's string table of significant keys and key=value pairs
+	struct SignificantTagPositions {
+		bool all;								///< no keys were given, so everything is significant
+		std::unordered_set<int> keys;
+		std::set<std::pair<int, int>> keyValues;
+	};
+
 	bool ReadNodes(PrimitiveGroup &pg, PrimitiveBlock const &pb, const std::unordered_set<int> &nodeKeyPositions);
 
-	bool ReadWays(PrimitiveGroup &pg, PrimitiveBlock const &pb);
+	bool ReadWays(PrimitiveGroup &pg, PrimitiveBlock const &pb, const SignificantTagPositions &wayKeyPositions);
+
+	bool ReadRelations(PrimitiveGroup &pg, PrimitiveBlock const &pb, const SignificantTagPositions &wayKeyPositions);
+
+	/// Find the positions of significant keys ("key" or "key=value") in the dictionary
+	static SignificantTagPositions findSignificantTagPositions(PrimitiveBlock const &pb, std::unordered_set<std::string> const &keys);
 
-	bool ReadRelations(PrimitiveGroup &pg, PrimitiveBlock const &pb);
+	/// Does a way or relation have any significant tags?
+	template<class Object>
+	static bool isSignificant(Object const &object, SignificantTagPositions const &positions) {
+		if (positions.all) return true;
+		for (int n=0; n < object.keys_size(); n++) {
+			if (positions.keys.count(object.keys(n))) return true;
+			if (positions.keyValues.count(std::make_pair(object.keys(n), object.vals(n)))) return true;
+		}
+		return false;
+	}
 
 	/// Find a string in the dictionary
 	static int findStringPosition(PrimitiveBlock const &pb, char const *str);
@@ -99,11 +135,12 @@ private:
         tag_map_t tags;
     };
 
-	std::deque<PbfNodeEntry> node_entries;
-	std::deque<PbfWayEntry> way_entries;
-	std::deque<PbfRelationEntry> relation_entries;
+	std::vector<PbfNodeEntry> node_entries;
+	std::vector<PbfWayEntry> way_entries;
+	std::vector<PbfRelationEntry> relation_entries;
 
 	OSMStore &osmStore;
+	std::unique_ptr<boost::asio::thread_pool> pool;		// created on first use with one thread per output
 };
 
 int ReadPbfBoundingBox(const std::string &inputFile, double &minLon, double &maxLon, 
@@ -4,13 +4,19 @@
 
 #include <vector>
 #include <map>
+#include <mutex>
+#include <tuple>
 
 #include "rapidjson/document.h"
 
 #include "osm_store.h"
 #include "output_object.h"
 #include "mbtiles.h"
+#include "pmtiles.h"
 #include "tile_data.h"
+#include "clip_cache.h"
+#include "simplify_cache.h"
+#include "simplify.h"
 
 ///\brief Defines map single layer appearance
 struct LayerDef {
@@ -21,9 +27,11 @@ struct LayerDef {
 	double simplifyLevel;
 	double simplifyLength;
 	double simplifyRatio;
+	SimplifyAlgorithm simplifyAlgorithm;
 	uint filterBelow;
 	double filterArea;
 	uint combinePolygonsBelow;
+	bool combineReversed;
 	std::string source;
 	std::vector<std::string> sourceColumns;
 	bool allSourceColumns;
@@ -43,7 +51,8 @@ public:
 	// Define a layer (as read from the .json file)
 	uint addLayer(std::string name, uint minzoom, uint maxzoom,
 			uint simplifyBelow, double simplifyLevel, double simplifyLength, double simplifyRatio, 
-			uint filterBelow, double filterArea, uint combinePolygonsBelow,
+			SimplifyAlgorithm simplifyAlgorithm,
+			uint filterBelow, double filterArea, uint combinePolygonsBelow, bool combineReversed,
 			const std::string &source,
 			const std::vector<std::string> &sourceColumns,
 			bool allSourceColumns,
@@ -64,6 +73,8 @@ public:
 	uint mvtVersion, combineBelow;
 	bool includeID, compress, gzip;
 	std::string compressOpt;
+	uint mbtilesBatchSize;
+	bool mbtilesFastBulk, mbtilesDeduplicate;
 	bool clippingBoxFromJSON;
 	double minLon, minLat, maxLon, maxLat;
 	std::string projectName, projectVersion, projectDesc;
@@ -81,14 +92,28 @@ class SharedData {
 
 public:
 	const class LayerDefinition &layers;
+	const AttributeStore &attributeStore;
 	bool sqlite;
 	bool mergeSqlite;
 	MBTiles mbtiles;
+	bool pmtiles;
+	PMTiles pmtilesFile;
+
+	/// Encoded tiles which are entirely covered by a single polygon, which are the same for
+	/// every such tile at a zoom level: by zoom, layer, attribute set and ID (if included)
+	std::map<std::tuple<uint, uint_least8_t, AttributeStoreRef, NodeID>, std::string> coveredTiles;
+	std::mutex coveredTilesMutex;
+
+	/// Large geometries already clipped to lower-zoom tiles, to clip their children from
+	ClipCache clipCache;
+
+	/// Large geometries simplified for each zoom level, which tiles clip from
+	SimplifyCache simplifyCache;
 	std::string outputFile;
 
 	Config &config;
 
-	SharedData(Config &configIn, const class LayerDefinition &layers);
+	SharedData(Config &configIn, const class LayerDefinition &layers, const AttributeStore &attributeStore);
 	virtual ~SharedData();
 };
 
@@ -22,7 +22,7 @@ public:
 		bool isIndexed, bool hasName, const std::string &name, AttributeStoreRef attributes);
 
 	void AddObject(TileCoordinates const &index, OutputObjectRef const &oo) {
-		tileIndex[index].push_back(oo);
+		TileDataSource::AddObject(index, oo);
 	}
 private:
 	std::vector<uint> findIntersectingGeometries(const std::string &layerName, Box &box) const;
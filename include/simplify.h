@@ -0,0 +1,251 @@
+/*! \file */
+#ifndef _SIMPLIFY_H
+#define _SIMPLIFY_H
+
+#include <vector>
+#include <queue>
+#include <utility>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include "geomtypes.h"
+
+/*	Simplifying linestrings and rings
+
+	These work on any vector of points: Boost points (when simplifying a whole geometry in
+	advance), or integer tile co-ordinates (when writing a tile), so that we simplify after
+	quantisation and never keep points which round to the same place.
+
+	- Douglas-Peucker keeps the points more than the tolerance away from the simplified line
+	- Visvalingam-Whyatt drops the points whose triangle with their neighbours has an area
+	  under tolerance², smallest first
+
+	A simplified ring which would cross or touch itself is left unsimplified, so rings stay valid
+	without needing a separate validity check.
+*/
+
+enum class SimplifyAlgorithm : uint8_t { DOUGLAS_PEUCKER, VISVALINGAM };
+
+namespace simplify {
+
+inline double getX(Point const &p) { return p.x(); }
+inline double getY(Point const &p) { return p.y(); }
+inline double getX(std::pair<int,int> const &p) { return p.first; }
+inline double getY(std::pair<int,int> const &p) { return p.second; }
+
+/// Twice the signed area of the triangle a-b-c
+template<class PointT>
+double cross(PointT const &a, PointT const &b, PointT const &c) {
+	return (getX(b)-getX(a)) * (getY(c)-getY(a)) - (getY(b)-getY(a)) * (getX(c)-getX(a));
+}
+
+/// Squared distance from p to the segment a-b
+template<class PointT>
+double segmentDistanceSquared(PointT const &p, PointT const &a, PointT const &b) {
+	double dx = getX(b)-getX(a), dy = getY(b)-getY(a);
+	double px = getX(p)-getX(a), py = getY(p)-getY(a);
+	double length = dx*dx + dy*dy;
+	if (length > 0) {
+		double t = std::max(0.0, std::min(1.0, (px*dx + py*dy) / length));
+		px -= t*dx; py -= t*dy;
+	}
+	return px*px + py*py;
+}
+
+/// Remove consecutive repeated points
+template<class LineT>
+void removeRepeated(LineT &points) {
+	typedef typename LineT::value_type PointT;
+	points.erase(std::unique(points.begin(), points.end(), [](PointT const &a, PointT const &b) {
+		return getX(a)==getX(b) && getY(a)==getY(b);
+	}), points.end());
+}
+
+/// Douglas-Peucker: mark the points to keep (always including the first and last)
+template<class LineT>
+void douglasPeucker(LineT const &points, double tolerance, std::vector<bool> &keep) {
+	keep.assign(points.size(), false);
+	if (points.empty()) return;
+	keep.front() = keep.back() = true;
+
+	double toleranceSquared = tolerance * tolerance;
+	std::vector<std::pair<size_t,size_t>> stack;
+	stack.emplace_back(0, points.size()-1);
+	while (!stack.empty()) {
+		size_t first = stack.back().first, last = stack.back().second;
+		stack.pop_back();
+		double furthestDistance = 0;
+		size_t furthest = first;
+		for (size_t i=first+1; i<last; i++) {
+			double d = segmentDistanceSquared(points[i], points[first], points[last]);
+			if (d > furthestDistance) { furthestDistance = d; furthest = i; }
+		}
+		if (furthestDistance > toleranceSquared) {
+			keep[furthest] = true;
+			stack.emplace_back(first, furthest);
+			stack.emplace_back(furthest, last);
+		}
+	}
+}
+
+/// Visvalingam-Whyatt: mark the points to keep (always including the first and last, and at least minPoints)
+template<class LineT>
+void visvalingam(LineT const &points, double tolerance, size_t minPoints, std::vector<bool> &keep) {
+	size_t n = points.size();
+	keep.assign(n, true);
+	if (n < 3) return;
+
+	double threshold = tolerance * tolerance;
+	std::vector<size_t> prev(n), next(n);
+	std::vector<double> area(n, 0.0);
+	typedef std::pair<double,size_t> Entry;
+	std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+	for (size_t i=0; i<n; i++) { prev[i] = i-1; next[i] = i+1; }
+	for (size_t i=1; i<n-1; i++) {
+		area[i] = std::fabs(cross(points[i-1], points[i], points[i+1])) / 2;
+		heap.emplace(area[i], i);
+	}
+
+	size_t remaining = n;
+	double lastArea = 0;
+	while (!heap.empty() && remaining > minPoints) {
+		Entry top = heap.top();
+		heap.pop();
+		size_t i = top.second;
+		if (!keep[i] || top.first != area[i]) continue;		// already removed, or the area has changed since
+		if (top.first >= threshold) break;
+
+		keep[i] = false;
+		remaining--;
+		lastArea = top.first;
+		size_t p = prev[i], q = next[i];
+		next[p] = q;
+		prev[q] = p;
+
+		// neighbours are never less significant than the point just removed
+		if (p > 0) {
+			area[p] = std::max(lastArea, std::fabs(cross(points[prev[p]], points[p], points[q])) / 2);
+			heap.emplace(area[p], p);
+		}
+		if (q < n-1) {
+			area[q] = std::max(lastArea, std::fabs(cross(points[p], points[q], points[next[q]])) / 2);
+			heap.emplace(area[q], q);
+		}
+	}
+}
+
+/// Do the segments a-b and c-d cross or touch?
+template<class PointT>
+bool segmentsIntersect(PointT const &a, PointT const &b, PointT const &c, PointT const &d) {
+	double d1 = cross(c,d,a), d2 = cross(c,d,b), d3 = cross(a,b,c), d4 = cross(a,b,d);
+	if (((d1>0 && d2<0) || (d1<0 && d2>0)) && ((d3>0 && d4<0) || (d3<0 && d4>0))) return true;
+
+	// r is collinear with p-q: is it within it?
+	auto within = [](PointT const &p, PointT const &q, PointT const &r) {
+		return std::min(getX(p),getX(q)) <= getX(r) && getX(r) <= std::max(getX(p),getX(q)) &&
+		       std::min(getY(p),getY(q)) <= getY(r) && getY(r) <= std::max(getY(p),getY(q));
+	};
+	return (d1==0 && within(c,d,a)) || (d2==0 && within(c,d,b)) ||
+	       (d3==0 && within(a,b,c)) || (d4==0 && within(a,b,d));
+}
+
+/** \brief Call f(a,b) for pairs of segments a<b in a closed ring which are near each other
+ *	(including every pair which intersects, and sometimes a pair more than once).
+ *	Stops and returns false if f returns false.
+ */
+template<class RingT, class F>
+bool forNearbySegments(RingT const &ring, F f) {
+	if (ring.size() < 2) return true;
+	size_t n = ring.size() - 1;			// number of segments
+
+	// Put the segments in a grid, so that we only compare those which are near each other
+	double minX = getX(ring[0]), maxX = minX, minY = getY(ring[0]), maxY = minY;
+	for (auto const &p: ring) {
+		minX = std::min(minX, getX(p)); maxX = std::max(maxX, getX(p));
+		minY = std::min(minY, getY(p)); maxY = std::max(maxY, getY(p));
+	}
+	size_t cells = std::max(size_t(1), size_t(std::sqrt(double(n))));
+	double cellWidth  = maxX>minX ? (maxX-minX) / cells : 1;
+	double cellHeight = maxY>minY ? (maxY-minY) / cells : 1;
+	auto column = [&](double x) { return std::min(cells-1, size_t((x-minX) / cellWidth )); };
+	auto row    = [&](double y) { return std::min(cells-1, size_t((y-minY) / cellHeight)); };
+
+	std::vector<std::vector<size_t>> grid(cells * cells);
+	for (size_t i=0; i<n; i++) {
+		size_t x0 = column(std::min(getX(ring[i]), getX(ring[i+1]))), x1 = column(std::max(getX(ring[i]), getX(ring[i+1])));
+		size_t y0 = row   (std::min(getY(ring[i]), getY(ring[i+1]))), y1 = row   (std::max(getY(ring[i]), getY(ring[i+1])));
+		for (size_t x=x0; x<=x1; x++) for (size_t y=y0; y<=y1; y++) grid[y*cells+x].push_back(i);
+	}
+
+	for (auto const &cell: grid) {
+		for (size_t j=0; j<cell.size(); j++) {
+			for (size_t k=j+1; k<cell.size(); k++) {
+				if (!f(cell[j], cell[k])) return false;
+			}
+		}
+	}
+	return true;
+}
+
+/// Is a closed ring simple: no segment crosses or touches another, and it never doubles back on itself?
+template<class RingT>
+bool isSimpleRing(RingT const &ring) {
+	if (ring.size() < 4) return false;
+	size_t n = ring.size() - 1;
+	return forNearbySegments(ring, [&](size_t a, size_t b) {
+		if (b == a+1 || (a == 0 && b == n-1)) {
+			// neighbours share a point, and mustn't turn back along the same line
+			size_t shared = b == a+1 ? b : 0;
+			auto const &p = ring[shared];
+			auto const &before = b == a+1 ? ring[a] : ring[n-1];
+			auto const &after  = b == a+1 ? ring[b+1] : ring[1];
+			return !(cross(before, p, after) == 0 &&
+			         (getX(before)-getX(p)) * (getX(after)-getX(p)) + (getY(before)-getY(p)) * (getY(after)-getY(p)) > 0);
+		}
+		return !segmentsIntersect(ring[a], ring[a+1], ring[b], ring[b+1]);
+	});
+}
+
+/// Simplify a linestring in place
+template<class LineT>
+void simplifyLine(LineT &line, double tolerance, SimplifyAlgorithm algorithm) {
+	removeRepeated(line);
+	if (line.size() < 3) return;
+
+	std::vector<bool> keep;
+	if (algorithm == SimplifyAlgorithm::VISVALINGAM) visvalingam(line, tolerance, 2, keep);
+	else douglasPeucker(line, tolerance, keep);
+	size_t j = 0;
+	for (size_t i=0; i<line.size(); i++) {
+		if (keep[i]) line[j++] = line[i];
+	}
+	line.resize(j);
+}
+
+/** \brief Simplify a closed ring in place
+ *	Returns false if it collapses to fewer than four points, in which case it should be dropped.
+ *	If the simplified ring wouldn't be simple, the ring is left as it was.
+ */
+template<class RingT>
+bool simplifyRing(RingT &ring, double tolerance, SimplifyAlgorithm algorithm) {
+	removeRepeated(ring);
+	if (ring.size() < 4) return false;
+
+	std::vector<bool> keep;
+	if (algorithm == SimplifyAlgorithm::VISVALINGAM) visvalingam(ring, tolerance, 4, keep);
+	else douglasPeucker(ring, tolerance, keep);
+	RingT simplified;
+	for (size_t i=0; i<ring.size(); i++) {
+		if (keep[i]) simplified.push_back(ring[i]);
+	}
+	if (simplified.size() < 4) return false;
+	if (algorithm == SimplifyAlgorithm::VISVALINGAM && simplified.size() == 4 &&
+	    std::fabs(cross(simplified[0], simplified[1], simplified[2])) / 2 < tolerance * tolerance) return false;
+	if (simplified.size() < ring.size() && isSimpleRing(simplified)) ring = std::move(simplified);
+	return true;
+}
+
+} // namespace simplify
+
+#endif //_SIMPLIFY_H
@@ -0,0 +1,124 @@
+/*! \file */
+#ifndef _SIMPLIFY_CACHE_H
+#define _SIMPLIFY_CACHE_H
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <tuple>
+#include <limits>
+#include "geomtypes.h"
+#include "osm_store.h"
+
+/** \brief Cache of whole geometries simplified for a zoom level
+*
+* An object which spans many tiles would otherwise be clipped and then simplified (at the
+* same tolerance) in every one of them. Instead it is simplified once, on first use, and
+* each tile clips the simplified result.
+*
+* Entries are keyed by (zoom, geometry handle, layer): the layer's settings fix the simplify
+* level and algorithm for an object at each zoom. Like ClipCache, each cache holds a bounded
+* number of points, dropping the oldest entries first; a dropped geometry is simplified again
+* when it's next needed. Entries are also dropped with clearZoom() once a zoom's tiles are written.
+*/
+class SimplifyCache {
+
+public:
+	/// Hold up to maxPoints points of each geometry type
+	SimplifyCache(size_t maxPoints = 8*1024*1024) : polygons(maxPoints), linestrings(maxPoints) { }
+
+	/// Find the simplified geometry, if we have it
+	bool find(uint zoom, OSMStore::handle_t handle, uint layer, std::shared_ptr<const MultiPolygon> &out) { return polygons.find(Key(zoom, handle, layer), out); }
+	bool find(uint zoom, OSMStore::handle_t handle, uint layer, std::shared_ptr<const Linestring> &out) { return linestrings.find(Key(zoom, handle, layer), out); }
+
+	/// Remember the simplified geometry, returning the entry to use (another thread may have got there first)
+	std::shared_ptr<const MultiPolygon> add(uint zoom, OSMStore::handle_t handle, uint layer, std::shared_ptr<const MultiPolygon> geometry) {
+		size_t points = 0;
+		for (auto const &poly: *geometry) {
+			points += poly.outer().size();
+			for (auto const &inner: poly.inners()) points += inner.size();
+		}
+		return polygons.add(Key(zoom, handle, layer), geometry, points);
+	}
+	std::shared_ptr<const Linestring> add(uint zoom, OSMStore::handle_t handle, uint layer, std::shared_ptr<const Linestring> geometry) {
+		return linestrings.add(Key(zoom, handle, layer), geometry, geometry->size());
+	}
+
+	/// Forget everything at this zoom level
+	void clearZoom(uint zoom) {
+		polygons.clearZoom(zoom);
+		linestrings.clearZoom(zoom);
+	}
+
+private:
+	typedef std::tuple<uint, OSMStore::handle_t, uint> Key;
+	static const unsigned SHARDS = 16;
+
+	template <class T>
+	class Store {
+
+	public:
+		Store(size_t maxPoints) : maxPoints(maxPoints / SHARDS) { }
+
+		bool find(Key const &key, std::shared_ptr<const T> &out) {
+			Shard &shard = shardFor(std::get<1>(key));
+			std::lock_guard<std::mutex> lock(shard.m);
+			auto it = shard.entries.find(key);
+			if (it == shard.entries.end()) return false;
+			out = it->second;
+			return true;
+		}
+
+		std::shared_ptr<const T> add(Key const &key, std::shared_ptr<const T> geometry, size_t points) {
+			if (points > maxPoints) return geometry;
+			Shard &shard = shardFor(std::get<1>(key));
+			std::lock_guard<std::mutex> lock(shard.m);
+			auto added = shard.entries.emplace(key, geometry);
+			if (!added.second) return added.first->second;
+			shard.order.emplace_back(key, points);
+			shard.points += points;
+			while (shard.points > maxPoints) {
+				shard.entries.erase(shard.order.front().first);
+				shard.points -= shard.order.front().second;
+				shard.order.pop_front();
+			}
+			return geometry;
+		}
+
+		void clearZoom(uint zoom) {
+			for (auto &shard: shards) {
+				std::lock_guard<std::mutex> lock(shard.m);
+				shard.entries.erase(shard.entries.lower_bound(Key(zoom, std::numeric_limits<OSMStore::handle_t>::min(), 0)),
+				                    shard.entries.lower_bound(Key(zoom+1, std::numeric_limits<OSMStore::handle_t>::min(), 0)));
+				std::deque<std::pair<Key, size_t>> remaining;
+				shard.points = 0;
+				for (auto const &entry: shard.order) {
+					if (std::get<0>(entry.first) == zoom) continue;
+					remaining.push_back(entry);
+					shard.points += entry.second;
+				}
+				shard.order.swap(remaining);
+			}
+		}
+
+	private:
+		struct Shard {
+			std::mutex m;
+			std::map<Key, std::shared_ptr<const T>> entries;
+			std::deque<std::pair<Key, size_t>> order;		// oldest first, with number of points
+			size_t points = 0;
+		};
+
+		// (handles are aligned offsets, so mix the bits before picking a shard)
+		Shard &shardFor(OSMStore::handle_t handle) { return shards[((uint64_t(handle) * 0x9E3779B97F4A7C15ULL) >> 32) % SHARDS]; }
+
+		size_t maxPoints;
+		Shard shards[SHARDS];
+	};
+
+	Store<MultiPolygon> polygons;
+	Store<Linestring> linestrings;
+};
+
+#endif //_SIMPLIFY_CACHE_H
@@ -3,11 +3,13 @@
 #include<functional>
 #include<stdexcept>
 #include<iostream>
+#include<memory>
 #include"sqlite3.h"
 
 /*
 	This is an earlier version of sqlite_modern_cpp (current versions break on OS X), lightly patched
-	to include a database.init() method, and to use the && operator for inserting blobs.
+	to include a database.init() method, and to use the && operator for inserting blobs;
+	and with database.prepare()/execute() for reusing a statement.
 	-- Richard Fairhurst, 28.06.2015
 */
 
@@ -51,6 +53,7 @@ namespace sqlite {
 		std::string _sql;
 		sqlite3_stmt* _stmt;
 		int _inx;
+		bool _reusable;
 
 		void _extract(std::function<void(void)> call_back) {
 			int hresult;
@@ -88,16 +91,17 @@ namespace sqlite {
 			_db(db),
 			_sql(sql),
 			_stmt(nullptr),
-			_inx(1) {
+			_inx(1),
+			_reusable(false) {
 			_prepare();
 		}
 
 	public:
 		friend class database;
 		~database_binder() noexcept(false) {
-			/* Will be executed if no >>op is found */
+			/* Will be executed if no >>op is found (unless it's a prepared statement) */
 			if (_stmt) {
-				if (sqlite3_step(_stmt) != SQLITE_DONE) {
+				if (!_reusable && sqlite3_step(_stmt) != SQLITE_DONE) {
 					throw std::runtime_error(sqlite3_errmsg(_db));
 				}
 
@@ -106,6 +110,16 @@ namespace sqlite {
 				_stmt = nullptr;
 			}
 		}
+		/* Run a prepared statement (see database::prepare) with the values bound so far,
+		   and make it ready to be bound again */
+		void execute() {
+			if (sqlite3_step(_stmt) != SQLITE_DONE)
+				throw std::runtime_error(sqlite3_errmsg(_db));
+			sqlite3_reset(_stmt);
+			sqlite3_clear_bindings(_stmt);
+			_inx = 1;
+		}
+
 #pragma region operator <<
 		database_binder& operator <<(double val) {
 			if (sqlite3_bind_double(_stmt, _inx, val) != SQLITE_OK)
@@ -262,6 +276,13 @@ namespace sqlite {
 			return database_binder(_db, sql);
 		}
 
+		/* Prepare a statement which can be run many times with execute() */
+		std::unique_ptr<database_binder> prepare(std::string const& sql) const {
+			std::unique_ptr<database_binder> binder(new database_binder(_db, sql));
+			binder->_reusable = true;
+			return binder;
+		}
+
 		operator bool() const {
 			return _connected;
 		}
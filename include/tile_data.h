@@ -4,67 +4,87 @@
 
 #include <map>
 #include <set>
+#include <deque>
 #include <vector>
 #include <memory>
 #include "output_object.h"
 
 typedef std::vector<OutputObjectRef>::const_iterator OutputObjectsConstIt;
 typedef std::pair<OutputObjectsConstIt, OutputObjectsConstIt> OutputObjectsConstItPair;
-typedef std::map<TileCoordinates, std::vector<OutputObjectRef>, TileCoordinatesCompare > TileIndex;
-typedef std::set<TileCoordinates, TileCoordinatesCompare> TileCoordinatesSet;
+
+/// An object in a base zoom tile, identified by the tile's Morton code (see tile2morton)
+struct TileIndexEntry {
+	uint64_t tile;
+	OutputObjectRef oo;
+
+	/// Order by tile, then by object (in output order)
+	bool operator<(TileIndexEntry const &other) const { 
+		if (tile != other.tile) return tile < other.tile;
+		return oo < other.oo;
+	}
+};
+
+/**
+ * Flat index of (tile, object) entries. Once sorted, the contents of any tile at
+ * any zoom level are a single contiguous range, as Morton order keeps descendants together;
+ * and the objects within each base zoom tile are a run sorted in output order.
+ */
+typedef std::vector<TileIndexEntry> TileIndex;
+typedef std::pair<TileIndex::const_iterator, TileIndex::const_iterator> TileIndexRun;
+typedef std::vector<TileCoordinates> TileCoordinatesList;
 
 class TileDataSource {
 
 protected:	
+	std::deque<OutputObject> objects;		// all objects, stored for the whole run
 	TileIndex tileIndex;
+	bool tileIndexSorted;
 	unsigned int baseZoom;
 
 public:
 	TileDataSource(unsigned int baseZoom) 
-		: baseZoom(baseZoom) 
+		: tileIndexSorted(true), baseZoom(baseZoom) 
 	{ }
 
-	///This must be thread safe!
-	void MergeTileCoordsAtZoom(uint zoom, TileCoordinatesSet &dstCoords) {
-		MergeTileCoordsAtZoom(zoom, baseZoom, tileIndex, dstCoords);
+	///Sort the index by tile and object, removing duplicates. Call this once all objects have been added, before reading tiles.
+	void SortIndex();
+
+	///Add the Morton codes of the tiles containing objects at each zoom level from startZoom to endZoom
+	///(dstTiles[zoom] must be sorted and unique, and stays so)
+	void MergeTileCoordsAtZooms(uint startZoom, uint endZoom, std::vector<std::vector<uint64_t>> &dstTiles) const {
+		MergeTileCoordsAtZooms(startZoom, endZoom, baseZoom, tileIndex, dstTiles);
+	}
+
+	///Count the index entries within a tile, as an estimate of the work needed to write it
+	std::size_t CountObjectsAtZoom(TileCoordinates dstIndex, uint zoom) const;
+
+	///Add the sorted runs of objects (one per base zoom tile) within a tile. This must be thread safe!
+	void CollectTileDataAtZoom(TileCoordinates dstIndex, uint zoom, std::vector<TileIndexRun> &dstRuns) const {
+		CollectTileDataAtZoom(dstIndex, zoom, baseZoom, tileIndex, dstRuns);
 	}
 
-	///This must be thread safe!
-	void MergeSingleTileDataAtZoom(TileCoordinates dstIndex, uint zoom, std::vector<OutputObjectRef> &dstTile) {
-		MergeSingleTileDataAtZoom(dstIndex, zoom, baseZoom, tileIndex, dstTile);
+	///Store an object (not thread safe), returning a reference which stays valid until Clear()
+	OutputObjectRef CreateObject(OutputObject const &oo) {
+		objects.push_back(oo);
+		return OutputObjectRef(&objects.back());
 	}
 
 	void AddObject(TileCoordinates const &index, OutputObjectRef const &oo) {
-		tileIndex[index].push_back(oo);
+		tileIndex.push_back({ tile2morton(index), oo });
+		tileIndexSorted = false;
 	}
 
 private:	
-	static void MergeTileCoordsAtZoom(uint zoom, uint baseZoom, const TileIndex &srcTiles, TileCoordinatesSet &dstCoords);
-	static void MergeSingleTileDataAtZoom(TileCoordinates dstIndex, uint zoom, uint baseZoom, const TileIndex &srcTiles, std::vector<OutputObjectRef> &dstTile);
+	static void MergeTileCoordsAtZooms(uint startZoom, uint endZoom, uint baseZoom, const TileIndex &srcTiles, std::vector<std::vector<uint64_t>> &dstTiles);
+	static void CollectTileDataAtZoom(TileCoordinates dstIndex, uint zoom, uint baseZoom, const TileIndex &srcTiles, std::vector<TileIndexRun> &dstRuns);
 
 };
 
-static inline TileCoordinatesSet GetTileCoordinates(std::vector<class TileDataSource *> const &sources, unsigned int zoom) {
-	TileCoordinatesSet tileCoordinates;
+/// Create the list of tiles to write at each zoom level from startZoom to endZoom (indexed by zoom), in Morton order
+std::vector<TileCoordinatesList> GetTileCoordinates(std::vector<class TileDataSource *> const &sources, unsigned int startZoom, unsigned int endZoom);
 
-	// Create list of tiles
-	tileCoordinates.clear();
-	for(size_t i=0; i<sources.size(); i++)
-		sources[i]->MergeTileCoordsAtZoom(zoom, tileCoordinates);
-
-	return tileCoordinates;
-}
-
-static inline std::vector<OutputObjectRef> GetTileData(std::vector<class TileDataSource *> const &sources, TileCoordinates coordinates, unsigned int zoom)
-{
-	std::vector<OutputObjectRef> data;
-	for(size_t i=0; i<sources.size(); i++)
-		sources[i]->MergeSingleTileDataAtZoom(coordinates, zoom, data);
-
-	sort(data.begin(), data.end());
-	data.erase(unique(data.begin(), data.end()), data.end());
-	return data;
-}
+/// Get the objects in a tile from all sources, sorted and without duplicates
+std::vector<OutputObjectRef> GetTileData(std::vector<class TileDataSource *> const &sources, TileCoordinates coordinates, unsigned int zoom);
 
 static inline OutputObjectsConstItPair GetObjectsAtSubLayer(std::vector<OutputObjectRef> const &data, uint_least8_t layerNum) {
     struct layerComp
@@ -6,24 +6,25 @@
 #include <utility>
 #include <boost/variant.hpp>
 #include "coordinates.h"
+#include "simplify.h"
 
-// Protobuf
-#include "osmformat.pb.h"
-#include "vector_tile.pb.h"
+#include "mvt_writer.h"
 
 typedef std::vector<std::pair<int,int> > XYString;
 
 /**
 	\brief WriteGeometryVisitor takes a boost::geometry object and writes it into a tile
+	If simplifyLevel is set, geometries are simplified once scaled to tile co-ordinates.
 */
 class WriteGeometryVisitor : public boost::static_visitor<> { 
 
 public:
 	const TileBbox *bboxPtr;
-	vector_tile::Tile_Feature *featurePtr;
+	MvtFeature *featurePtr;
 	double simplifyLevel;
+	SimplifyAlgorithm simplifyAlgorithm;
 
-	WriteGeometryVisitor(const TileBbox *bp, vector_tile::Tile_Feature *fp, double sl);
+	WriteGeometryVisitor(const TileBbox *bp, MvtFeature *fp, double sl, SimplifyAlgorithm sa = SimplifyAlgorithm::DOUGLAS_PEUCKER);
 
 	// Point
 	void operator()(const Point &p) const;
@@ -37,8 +38,11 @@ public:
 	// Linestring
 	void operator()(const Linestring &ls) const;
 
+	/// \brief Scale a ring or linestring to tile co-ordinates
+	template<class LineT> void scaleString(LineT const &points, XYString &scaledString) const;
+
 	/// \brief Encode a series of pixel co-ordinates into the feature, using delta and zigzag encoding
-	bool writeDeltaString(XYString *scaledString, vector_tile::Tile_Feature *featurePtr, std::pair<int,int> *lastPos, bool closePath) const;
+	bool writeDeltaString(XYString *scaledString, MvtFeature *featurePtr, std::pair<int,int> *lastPos, bool closePath) const;
 };
 
 #endif //_WRITE_GEOMETRY_H
@@ -2,6 +2,14 @@
 
 node_keys = { "amenity", "shop" }
 
+-- Ways (and multipolygon relations) will only be processed if one of these keys is present
+
+way_keys = { "highway", "waterway", "building" }
+
+-- node_function and way_function only look at tags, so their results can be reused
+
+pure_tag_functions = true
+
 -- Initialize Lua logic
 
 function init_function()
@@ -1,2 +1,65 @@
 #include "attribute_store.h"
+#include <iostream>
+#include <boost/functional/hash.hpp>
+using namespace std;
 
+size_t AttributeStore::value_hash::operator()(vector_tile::Tile_Value const &v) const {
+	size_t seed = static_cast<size_t>(type_index(v));
+	switch (type_index(v)) {
+		case Index::BOOL:   boost::hash_combine(seed, v.bool_value()); break;
+		case Index::FLOAT:  boost::hash_combine(seed, v.float_value()); break;
+		case Index::STRING: boost::hash_combine(seed, v.string_value()); break;
+	}
+	return seed;
+}
+
+bool AttributeStore::value_equal::operator()(vector_tile::Tile_Value const &lhs, vector_tile::Tile_Value const &rhs) const {
+	if (type_index(lhs) != type_index(rhs)) return false;
+	switch (type_index(lhs)) {
+		case Index::BOOL:   return lhs.bool_value() == rhs.bool_value();
+		case Index::FLOAT:  return lhs.float_value() == rhs.float_value();
+		case Index::STRING: return lhs.string_value() == rhs.string_value();
+	}
+	return false;
+}
+
+size_t AttributeStore::key_value_hash::operator()(key_value_t const &kv) const {
+	size_t seed = kv.key;
+	boost::hash_combine(seed, kv.value);
+	boost::hash_combine(seed, kv.minzoom);
+	return seed;
+}
+
+size_t AttributeStore::key_value_set_hash::operator()(key_value_set_entry_t const &set) const {
+	return boost::hash_range(set.begin(), set.end());
+}
+
+// Each set has a block of pairs for each distinct minzoom among its pairs, holding the pairs
+// which are written from that zoom (in the set's order)
+void AttributeStore::encodeSets() {
+	for (key_value_set_id_t id = encodedSets.size()-1; id < sets.size(); id++) {
+		key_value_set_entry_t const &set = sets.at(id);
+		boost::container::small_vector<char, 4> minzooms;
+		for (auto kv: set) minzooms.push_back(key_values.at(kv).minzoom);
+		std::sort(minzooms.begin(), minzooms.end());
+		minzooms.erase(std::unique(minzooms.begin(), minzooms.end()), minzooms.end());
+
+		for (char minzoom: minzooms) {
+			encoded_block_t block = { minzoom, uint32_t(encodedPairs.size()), 0 };
+			for (auto kv: set) {
+				key_value_t const &pair = key_values.at(kv);
+				if (pair.minzoom > minzoom) continue;
+				encodedPairs.push_back(pair.key);
+				encodedPairs.push_back(pair.value);
+				block.size += 2;
+			}
+			encodedBlocks.push_back(block);
+		}
+		encodedSets.push_back(encodedBlocks.size());
+	}
+}
+
+void AttributeStore::reportSize() const {
+	cout << "Attributes: " << keys.size() << " keys, " << values.size() << " values, "
+	     << key_values.size() << " key/value pairs, " << sets.size() << " sets" << endl;
+}
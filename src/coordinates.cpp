@@ -65,6 +65,36 @@ void fillCoveredTiles(unordered_set<TileCoordinates> &tileSet) {
 }
 
 
+// Spread the low 32 bits of v out to the even bits of the result
+static inline uint64_t spreadBits(uint64_t v) {
+	v &= 0xFFFFFFFF;
+	v = (v | (v << 16)) & 0x0000FFFF0000FFFF;
+	v = (v | (v <<  8)) & 0x00FF00FF00FF00FF;
+	v = (v | (v <<  4)) & 0x0F0F0F0F0F0F0F0F;
+	v = (v | (v <<  2)) & 0x3333333333333333;
+	v = (v | (v <<  1)) & 0x5555555555555555;
+	return v;
+}
+
+// Gather the even bits of v back into the low 32 bits of the result
+static inline uint64_t compactBits(uint64_t v) {
+	v &= 0x5555555555555555;
+	v = (v | (v >>  1)) & 0x3333333333333333;
+	v = (v | (v >>  2)) & 0x0F0F0F0F0F0F0F0F;
+	v = (v | (v >>  4)) & 0x00FF00FF00FF00FF;
+	v = (v | (v >>  8)) & 0x0000FFFF0000FFFF;
+	v = (v | (v >> 16)) & 0x00000000FFFFFFFF;
+	return v;
+}
+
+uint64_t tile2morton(TileCoordinates index) {
+	return spreadBits(index.x) | (spreadBits(index.y) << 1);
+}
+
+TileCoordinates morton2tile(uint64_t code) {
+	return TileCoordinates(compactBits(code), compactBits(code >> 1));
+}
+
 // ------------------------------------------------------
 // Helper class for dealing with spherical Mercator tiles
 
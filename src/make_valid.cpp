@@ -0,0 +1,187 @@
+/*
+	Repairing invalid geometries as they are read
+*/
+
+#include "make_valid.h"
+#include "simplify.h"
+#include <map>
+#include <algorithm>
+using namespace std;
+namespace geom = boost::geometry;
+
+// Add the points where a ring crosses or touches itself as vertices of the segments involved,
+// so that the ring only meets itself at vertices
+static void nodeRing(Ring &ring) {
+	size_t n = ring.size() - 1;
+	vector<vector<pair<double,Point>>> splits(n);		// for each segment: (distance along it, point)
+	simplify::forNearbySegments(ring, [&](size_t a, size_t b) {
+		if (b == a+1 || (a == 0 && b == n-1)) return true;
+		Point const &p = ring[a], &q = ring[b];
+		double rx = ring[a+1].x()-p.x(), ry = ring[a+1].y()-p.y();
+		double sx = ring[b+1].x()-q.x(), sy = ring[b+1].y()-q.y();
+		double denominator = rx*sy - ry*sx;
+		if (denominator == 0) return true;				// parallel (collinear overlaps are left as they are)
+		double qpx = q.x()-p.x(), qpy = q.y()-p.y();
+		double t = (qpx*sy - qpy*sx) / denominator;
+		double u = (qpx*ry - qpy*rx) / denominator;
+		if (t < 0 || t > 1 || u < 0 || u > 1) return true;
+
+		// use an existing vertex if it's at one, so that both segments get exactly the same point
+		Point x = t==0 ? p : t==1 ? ring[a+1] : u==0 ? q : u==1 ? ring[b+1] : Point(p.x() + t*rx, p.y() + t*ry);
+		if (t > 0 && t < 1) splits[a].emplace_back(t, x);
+		if (u > 0 && u < 1) splits[b].emplace_back(u, x);
+		return true;
+	});
+
+	Ring noded;
+	for (size_t i=0; i<n; i++) {
+		noded.push_back(ring[i]);
+		sort(splits[i].begin(), splits[i].end(), [](pair<double,Point> const &a, pair<double,Point> const &b) { return a.first < b.first; });
+		for (auto const &split: splits[i]) noded.push_back(split.second);
+	}
+	noded.push_back(ring[0]);
+	simplify::removeRepeated(noded);
+	ring = move(noded);
+}
+
+// Split a noded ring into loops, wherever it passes through a point more than once
+static void splitLoops(Ring const &ring, vector<Ring> &loops) {
+	vector<Point> path;
+	map<pair<double,double>, size_t> position;		// point -> index in path
+	for (size_t i=0; i+1<ring.size(); i++) {
+		Point const &p = ring[i];
+		auto found = position.find(make_pair(p.x(), p.y()));
+		if (found == position.end()) {
+			position[make_pair(p.x(), p.y())] = path.size();
+			path.push_back(p);
+			continue;
+		}
+		// we've come back to a point on the path, so the path since then is a loop
+		size_t start = found->second;
+		Ring loop(path.begin()+start, path.end());
+		loop.push_back(path[start]);
+		for (size_t j=start+1; j<path.size(); j++) position.erase(make_pair(path[j].x(), path[j].y()));
+		path.resize(start+1);
+		loops.push_back(move(loop));
+	}
+	Ring loop(path.begin(), path.end());
+	if (!path.empty()) loop.push_back(path[0]);
+	loops.push_back(move(loop));
+
+	// remove loops which enclose nothing
+	loops.erase(remove_if(loops.begin(), loops.end(), [](Ring const &r) { return r.size()<4 || geom::area(r)==0; }), loops.end());
+}
+
+// Rebuild a polygon from simple rings. Each loop of the outer ring becomes a polygon, except that
+// loops running the other way are holes if they're inside one of those. Loops of the holes are
+// holes of whichever polygon they're inside.
+static void repairPolygon(Polygon const &poly, MultiPolygon &out) {
+	vector<Ring> outerLoops, holes;
+	Ring outer = poly.outer();
+	if (!simplify::isSimpleRing(outer)) nodeRing(outer);
+	splitLoops(outer, outerLoops);
+	for (auto const &inner: poly.inners()) {
+		Ring ring = inner;
+		if (!simplify::isSimpleRing(ring)) nodeRing(ring);
+		splitLoops(ring, holes);
+	}
+
+	// (Boost's rings are clockwise, with positive area)
+	double orientation = geom::area(outer);
+	vector<Ring> reversedLoops;
+	size_t first = out.size();
+	for (auto &loop: outerLoops) {
+		if ((geom::area(loop) > 0) == (orientation > 0)) {
+			if (geom::area(loop) < 0) reverse(loop.begin(), loop.end());
+			out.emplace_back();
+			out.back().outer() = move(loop);
+		} else {
+			reversedLoops.push_back(move(loop));
+		}
+	}
+
+	auto addHole = [&](Ring &hole) {
+		if (geom::area(hole) > 0) reverse(hole.begin(), hole.end());
+		for (size_t i=first; i<out.size(); i++) {
+			if (geom::covered_by(hole, out[i].outer())) { out[i].inners().push_back(move(hole)); return true; }
+		}
+		return false;
+	};
+	for (auto &loop: reversedLoops) {
+		if (addHole(loop)) continue;
+		// not inside the rest of the outer ring, so it's a polygon of its own
+		reverse(loop.begin(), loop.end());
+		out.emplace_back();
+		out.back().outer() = move(loop);
+	}
+	for (auto &hole: holes) addHole(hole);
+}
+
+// Remove repeated points and close the ring. Returns false if it has too few points left to
+// enclose anything (a closed ring needs at least 4).
+static bool tidyRing(Ring &ring) {
+	simplify::removeRepeated(ring);
+	if (!ring.empty() && (ring.front().x() != ring.back().x() || ring.front().y() != ring.back().y())) ring.push_back(ring.front());
+	return ring.size() >= 4;
+}
+
+void cascadedUnion(vector<MultiPolygon> &parts, MultiPolygon &output) {
+	while (parts.size() > 1) {
+		vector<MultiPolygon> merged;
+		for (size_t i=0; i+1<parts.size(); i+=2) {
+			MultiPolygon result;
+			try {
+				geom::union_(parts[i], parts[i+1], result);
+			} catch (geom::overlay_invalid_input_exception &err) {
+				result = move(parts[i]);
+				result.insert(result.end(), parts[i+1].begin(), parts[i+1].end());
+			}
+			merged.push_back(move(result));
+		}
+		if (parts.size() % 2) merged.push_back(move(parts.back()));
+		parts.swap(merged);
+	}
+	if (!parts.empty()) output = move(parts[0]);
+}
+
+bool makeValid(MultiPolygon &mp) {
+	// Remove repeated points, and rings with too few points to enclose anything
+	MultiPolygon tidied;
+	for (auto &poly: mp) {
+		if (!tidyRing(poly.outer())) continue;
+		auto &inners = poly.inners();
+		for (auto &inner: inners) tidyRing(inner);
+		inners.erase(remove_if(inners.begin(), inners.end(), [](Ring const &r) { return r.size() < 4; }), inners.end());
+		tidied.push_back(move(poly));
+	}
+	mp = move(tidied);
+	geom::correct(mp);								// fixes the rings' winding
+	if (geom::is_valid(mp)) return true;
+
+	// Split rings which cross or touch themselves into simple ones
+	geom::remove_spikes(mp);
+	MultiPolygon repaired;
+	for (auto const &poly: mp) repairPolygon(poly, repaired);
+	geom::correct(repaired);
+	if (!geom::is_valid(repaired)) {
+		// The parts may overlap each other: if each one is valid, merge them
+		bool partsValid = all_of(repaired.begin(), repaired.end(), [](Polygon const &p) { return geom::is_valid(p); });
+		if (partsValid) {
+			vector<MultiPolygon> parts;
+			for (auto &poly: repaired) {
+				parts.emplace_back();
+				parts.back().push_back(move(poly));
+			}
+			MultiPolygon merged;
+			cascadedUnion(parts, merged);
+			repaired = move(merged);
+		}
+	}
+	mp = move(repaired);
+	return geom::is_valid(mp);
+}
+
+bool makeValid(Linestring &ls) {
+	simplify::removeRepeated(ls);
+	return ls.size() >= 2;
+}
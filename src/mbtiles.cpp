@@ -2,6 +2,10 @@
 #include "mbtiles.h"
 #include "helpers.h"
 #include <cmath>
+#include <algorithm>
+#include <tuple>
+#include <cstdio>
+#include <functional>
 #include <boost/iostreams/filtering_streambuf.hpp>
 #include <boost/iostreams/copy.hpp>
 #include <boost/iostreams/stream.hpp>
@@ -13,26 +17,60 @@ using namespace sqlite;
 using namespace std;
 namespace bio = boost::iostreams;
 
-MBTiles::MBTiles() {}
+MBTiles::MBTiles() : batchSize(1000), deduplicate(false), closing(false) {}
+
+// Identify a tile by its contents (96 bits, from two independent hashes and its length)
+static string tileHash(string const &data) {
+	char id[33];
+	snprintf(id, sizeof(id), "%016llx%08lx%08x",
+		static_cast<unsigned long long>(hash<string>()(data)),
+		crc32(0, reinterpret_cast<const Bytef*>(data.data()), data.size()),
+		static_cast<unsigned>(data.size()));
+	return id;
+}
 
 MBTiles::~MBTiles() {
-	if (db && inTransaction) db << "COMMIT;"; // commit all the changes if open
+	stopWriter();
 }
 
 // ---- Write .mbtiles
 
-void MBTiles::openForWriting(string *filename) {
+void MBTiles::openForWriting(string *filename, size_t batchSize, bool fastBulk, bool deduplicate) {
+	this->batchSize = batchSize;
+	this->deduplicate = deduplicate;
 	db.init(*filename);
 	db << "PRAGMA synchronous = OFF;";
+	if (fastBulk) {
+		// larger pages and cache, and no rollback journal (page size must be set before creating tables)
+		string journalMode;
+		db << "PRAGMA page_size = 65536;";
+		db << "PRAGMA cache_size = -262144;";
+		db << "PRAGMA journal_mode = OFF;" >> journalMode;
+	}
 	try {
 		db << "PRAGMA application_id = 0x4d504258;";
 	} catch(runtime_error &e) {
 		cout << "Couldn't write SQLite application_id (not fatal): " << e.what() << endl;
 	}
 	db << "CREATE TABLE IF NOT EXISTS metadata (name text, value text, UNIQUE (name));";
-	db << "CREATE TABLE IF NOT EXISTS tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob, UNIQUE (zoom_level, tile_column, tile_row));";
-	db << "BEGIN;"; // begin a transaction
-	inTransaction = true;
+
+	// With fastBulk, each tile is only written once, so we don't need the unique index until closeForWriting()
+	string tileTable = deduplicate ? "map" : "tiles";
+	string tileColumn = deduplicate ? "tile_id text" : "tile_data blob";
+	db << "CREATE TABLE IF NOT EXISTS " + tileTable + " (zoom_level integer, tile_column integer, tile_row integer, " + tileColumn +
+		(fastBulk ? ");" : ", UNIQUE (zoom_level, tile_column, tile_row));");
+	insertTile = db.prepare((fastBulk ? "INSERT" : "REPLACE") + string(" INTO ") + tileTable + " VALUES (?,?,?,?);");
+
+	if (deduplicate) {
+		// Each distinct tile is stored once in images, and map refers to it by hash
+		db << "CREATE TABLE IF NOT EXISTS images (tile_data blob, tile_id text, UNIQUE (tile_id));";
+		db << "CREATE VIEW IF NOT EXISTS tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, "
+		      "map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id;";
+		insertImage = db.prepare("INSERT OR IGNORE INTO images (tile_data, tile_id) VALUES (?,?);");
+	}
+
+	closing = false;
+	writer = thread(&MBTiles::writeTiles, this);
 }
 	
 void MBTiles::writeMetadata(string key, string value) {
@@ -41,15 +79,72 @@ void MBTiles::writeMetadata(string key, string value) {
 	m.unlock();
 }
 	
-void MBTiles::saveTile(int zoom, int x, int y, string *data) {
+void MBTiles::saveTile(int zoom, int x, int y, string data) {
 	int tmsY = pow(2,zoom) - 1 - y;
-	m.lock();
-	db << "REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?,?,?,?);" << zoom << x << tmsY && *data;
-	m.unlock();
+	unique_lock<mutex> lock(queueMutex);
+	queueNotFull.wait(lock, [&]() { return queue.size() < 2 * batchSize; });
+	queue.push_back(PendingTile { zoom, x, tmsY, std::move(data) });
+	queueNotEmpty.notify_one();
+}
+
+// Writer thread: insert queued tiles in batches until stopWriter() is called and the queue is empty
+void MBTiles::writeTiles() {
+	vector<PendingTile> batch;
+	while (true) {
+		{
+			unique_lock<mutex> lock(queueMutex);
+			queueNotEmpty.wait(lock, [&]() { return !queue.empty() || closing; });
+			if (queue.empty()) return;
+			while (!queue.empty() && batch.size() < batchSize) {
+				batch.push_back(std::move(queue.front()));
+				queue.pop_front();
+			}
+			queueNotFull.notify_all();
+		}
+
+		// insert in index order, so that the B-tree is updated sequentially
+		sort(batch.begin(), batch.end(), [](PendingTile const &a, PendingTile const &b) {
+			return make_tuple(a.zoom, a.x, a.y) < make_tuple(b.zoom, b.x, b.y);
+		});
+
+		lock_guard<mutex> lock(m);
+		db << "BEGIN;";
+		for (auto const &tile: batch) {
+			if (deduplicate) {
+				// identical tiles are only stored once
+				string tileID = tileHash(tile.data);
+				(*insertImage && tile.data) << tileID;
+				insertImage->execute();
+				*insertTile << tile.zoom << tile.x << tile.y << tileID;
+			} else {
+				*insertTile << tile.zoom << tile.x << tile.y && tile.data;
+			}
+			insertTile->execute();
+		}
+		db << "COMMIT;";
+		batch.clear();
+	}
+}
+
+// Write all queued tiles, and stop the writer thread
+void MBTiles::stopWriter() {
+	if (!writer.joinable()) return;
+	{
+		lock_guard<mutex> lock(queueMutex);
+		closing = true;
+	}
+	queueNotEmpty.notify_all();
+	writer.join();
+	insertTile.reset();
+	insertImage.reset();
 }
 
 void MBTiles::closeForWriting() {
-	db << "CREATE UNIQUE INDEX IF NOT EXISTS tile_index on tiles (zoom_level, tile_column, tile_row);";
+	stopWriter();
+	if (deduplicate)
+		db << "CREATE UNIQUE INDEX IF NOT EXISTS map_index on map (zoom_level, tile_column, tile_row);";
+	else
+		db << "CREATE UNIQUE INDEX IF NOT EXISTS tile_index on tiles (zoom_level, tile_column, tile_row);";
 }
 
 // ---- Read mbtiles
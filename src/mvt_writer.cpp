@@ -0,0 +1,97 @@
+#include "mvt_writer.h"
+#include <cstring>
+using namespace std;
+
+void MvtWriter::addFeature(MvtFeature const &feature) {
+	scratch.clear();
+	if (feature.hasId) {
+		mvt::writeKey(scratch, 1, 0);
+		mvt::writeVarint(scratch, feature.id);
+	}
+	if (!feature.tags.empty()) mvt::writeBytes(scratch, 2, feature.tags);
+	if (feature.hasType) {
+		mvt::writeKey(scratch, 3, 0);
+		mvt::writeVarint(scratch, feature.type);
+	}
+	if (!feature.geometry.empty()) mvt::writeBytes(scratch, 4, feature.geometry);
+	mvt::writeBytes(layer, 2, scratch);
+	features++;
+}
+
+void MvtWriter::addFeature(vector_tile::Tile_Feature const &feature) {
+	feature.SerializeToString(&scratch);
+	mvt::writeBytes(layer, 2, scratch);
+	features++;
+}
+
+// Write the fields of a value message
+void MvtWriter::writeValue(string &out, vector_tile::Tile_Value const &value) {
+	if (value.has_string_value()) {
+		mvt::writeBytes(out, 1, value.string_value());
+	}
+	if (value.has_float_value()) {
+		float f = value.float_value();
+		uint32_t bits;
+		memcpy(&bits, &f, sizeof(bits));
+		mvt::writeKey(out, 2, 5);
+		for (unsigned i=0; i<4; i++) out.push_back(char(bits >> (i*8)));
+	}
+	if (value.has_double_value()) {
+		double d = value.double_value();
+		uint64_t bits;
+		memcpy(&bits, &d, sizeof(bits));
+		mvt::writeKey(out, 3, 1);
+		for (unsigned i=0; i<8; i++) out.push_back(char(bits >> (i*8)));
+	}
+	if (value.has_int_value()) {
+		mvt::writeKey(out, 4, 0);
+		mvt::writeVarint(out, uint64_t(value.int_value()));
+	}
+	if (value.has_uint_value()) {
+		mvt::writeKey(out, 5, 0);
+		mvt::writeVarint(out, value.uint_value());
+	}
+	if (value.has_sint_value()) {
+		int64_t s = value.sint_value();
+		mvt::writeKey(out, 6, 0);
+		mvt::writeVarint(out, (uint64_t(s) << 1) ^ uint64_t(s >> 63));
+	}
+	if (value.has_bool_value()) {
+		mvt::writeKey(out, 7, 0);
+		mvt::writeVarint(out, value.bool_value());
+	}
+}
+
+void MvtWriter::endLayer(string const &name, uint32_t version, uint32_t extent,
+	vector<string> const &keys, vector<vector_tile::Tile_Value> const &values) {
+
+	if (features == 0) return;
+
+	// The name comes before the features, and everything else after them
+	string header;
+	mvt::writeBytes(header, 1, name);
+
+	scratch.clear();
+	for (auto const &key : keys) mvt::writeBytes(scratch, 3, key);
+	string value;
+	for (auto const &v : values) {
+		value.clear();
+		writeValue(value, v);
+		mvt::writeBytes(scratch, 4, value);
+	}
+	mvt::writeKey(scratch, 5, 0);
+	mvt::writeVarint(scratch, extent);
+	mvt::writeKey(scratch, 15, 0);
+	mvt::writeVarint(scratch, version);
+
+	mvt::writeKey(tile, 3, 2);
+	mvt::writeVarint(tile, header.size() + layer.size() + scratch.size());
+	tile.append(header);
+	tile.append(layer);
+	tile.append(scratch);
+}
+
+void MvtWriter::addLayer(vector_tile::Tile_Layer const &existing) {
+	existing.SerializeToString(&scratch);
+	mvt::writeBytes(tile, 3, scratch);
+}
@@ -1,10 +1,15 @@
 #include "osm_lua_processing.h"
 #include "helpers.h"
+#include "make_valid.h"
+#include "osm_lua_ffi.h"
 #include <iostream>
+#include <boost/functional/hash.hpp>
 using namespace std;
 
-kaguya::State *g_luaState = nullptr;
+thread_local kaguya::State *g_luaState = nullptr;
 bool supportsRemappingShapefiles = false;
+const size_t MAX_RESULT_CACHE_SIZE = 100000;	// per Lua state
+WayID OsmLuaProcessing::newWayID = MAX_WAY_ID;
 
 int lua_error_handler(int errCode, const char *errMessage)
 {
@@ -14,6 +19,102 @@ int lua_error_handler(int errCode, const char *errMessage)
 	exit(0);
 }
 
+// Attribute type as recorded in the vector_layers metadata
+static uint metadataType(vector_tile::Tile_Value const &value) {
+	if (value.has_bool_value()) return 2;
+	if (value.has_string_value()) return 0;
+	return 1;
+}
+
+#ifdef LUAJIT
+// ----	C functions called through the LuaJIT FFI, avoiding kaguya's std::string conversions
+
+extern "C" {
+	static const char *ffi_find(OsmLuaProcessing *p, const char *key, size_t keyLength, size_t *valueLength) {
+		const string *value = p->FindValue(key, keyLength);
+		if (!value) return nullptr;
+		*valueLength = value->size();
+		return value->data();
+	}
+	static int ffi_holds(OsmLuaProcessing *p, const char *key, size_t keyLength) {
+		return p->FindValue(key, keyLength) != nullptr;
+	}
+	static int ffi_layer_id(OsmLuaProcessing *p, const char *name) {
+		return p->LayerId(name);
+	}
+	// C++ exceptions can't cross the FFI, so these report failure to the Lua side
+	static int ffi_layer(OsmLuaProcessing *p, int layer, int area) {
+		try {
+			p->LayerWithId(layer, area);
+		} catch (std::exception &err) {
+			cerr << err.what() << endl;
+			return 0;
+		}
+		return 1;
+	}
+	static int ffi_layer_as_centroid(OsmLuaProcessing *p, int layer) {
+		try {
+			p->LayerAsCentroidWithId(layer);
+		} catch (std::exception &err) {
+			cerr << err.what() << endl;
+			return 0;
+		}
+		return 1;
+	}
+	static int ffi_attribute_key(OsmLuaProcessing *p, const char *key) {
+		return p->AttributeKeyId(key);
+	}
+	static void ffi_attribute(OsmLuaProcessing *p, int key, const char *value, size_t valueLength, int minzoom) {
+		vector_tile::Tile_Value v;
+		v.set_string_value(value, valueLength);
+		p->AttributeWithKeyId(key, v, minzoom);
+	}
+	static void ffi_attribute_numeric(OsmLuaProcessing *p, int key, double value, int minzoom) {
+		vector_tile::Tile_Value v;
+		v.set_float_value(value);
+		p->AttributeWithKeyId(key, v, minzoom);
+	}
+	static void ffi_attribute_boolean(OsmLuaProcessing *p, int key, int value, int minzoom) {
+		vector_tile::Tile_Value v;
+		v.set_bool_value(value);
+		p->AttributeWithKeyId(key, v, minzoom);
+	}
+	static void ffi_min_zoom(OsmLuaProcessing *p, int z) {
+		p->MinZoom(z);
+	}
+}
+
+
+// Define the ffi_osm table, bound to this object, in our Lua state
+void OsmLuaProcessing::registerFFIBindings() {
+	lua_State *L = luaState.state();
+	if (luaL_loadstring(L, ffiBindings) != 0) {
+		cerr << "Couldn't load LuaJIT FFI bindings: " << lua_tostring(L, -1) << endl;
+		exit(EXIT_FAILURE);
+	}
+	lua_pushlightuserdata(L, this);
+	lua_newtable(L);
+	auto setFunction = [L](const char *name, void *fn) {
+		lua_pushlightuserdata(L, fn);
+		lua_setfield(L, -2, name);
+	};
+	setFunction("find", reinterpret_cast<void *>(&ffi_find));
+	setFunction("holds", reinterpret_cast<void *>(&ffi_holds));
+	setFunction("layer_id", reinterpret_cast<void *>(&ffi_layer_id));
+	setFunction("layer", reinterpret_cast<void *>(&ffi_layer));
+	setFunction("layer_as_centroid", reinterpret_cast<void *>(&ffi_layer_as_centroid));
+	setFunction("attribute_key", reinterpret_cast<void *>(&ffi_attribute_key));
+	setFunction("attribute", reinterpret_cast<void *>(&ffi_attribute));
+	setFunction("attribute_numeric", reinterpret_cast<void *>(&ffi_attribute_numeric));
+	setFunction("attribute_boolean", reinterpret_cast<void *>(&ffi_attribute_boolean));
+	setFunction("min_zoom", reinterpret_cast<void *>(&ffi_min_zoom));
+	if (lua_pcall(L, 2, 0, 0) != 0) {
+		cerr << "Couldn't set up LuaJIT FFI bindings: " << lua_tostring(L, -1) << endl;
+		exit(EXIT_FAILURE);
+	}
+}
+#endif
+
 // ----	initialization routines
 
 OsmLuaProcessing::OsmLuaProcessing(
@@ -30,11 +131,12 @@ OsmLuaProcessing::OsmLuaProcessing(
 	config(configIn),
 	layers(layers) {
 
-	newWayID = MAX_WAY_ID;
-
 	// ----	Initialise Lua
 	g_luaState = &luaState;
 	luaState.setErrorHandler(lua_error_handler);
+#ifdef LUAJIT
+	registerFFIBindings();
+#endif
 	luaState.dofile(luaFile.c_str());
 	luaState["OSM"].setClass(kaguya::UserdataMetatable<OsmLuaProcessing>()
 		.addFunction("Id", &OsmLuaProcessing::Id)
@@ -58,6 +160,11 @@ OsmLuaProcessing::OsmLuaProcessing(
 		supportsRemappingShapefiles = false;
 	}
 
+	// Can node_function/way_function results be reused for objects with the same tags?
+	cacheResults = luaState["pure_tag_functions"].get<bool>();
+	recording = false;
+	cacheable = false;
+
 	// ---- Call init_function of Lua logic
 
 	luaState("if init_function~=nil then init_function() end");
@@ -76,6 +183,117 @@ bool OsmLuaProcessing::empty() {
 	return outputs.size()==0;
 }
 
+// Clear current cached state before processing a new object
+void OsmLuaProcessing::reset() {
+	g_luaState = &luaState;		// this thread is now running our Lua state
+	outputs.clear();
+	linestringInited = false;
+	polygonInited = false;
+	multiPolygonInited = false;
+}
+
+size_t OsmLuaProcessing::ResultCacheHash::operator()(result_cache_key_t const &key) const {
+	size_t seed = key.first;
+	for (auto const &tag: key.second) {
+		boost::hash_combine(seed, tag.first);
+		boost::hash_combine(seed, tag.second);
+	}
+	return seed;
+}
+
+// Call node_function/way_function, unless it has already been called for the same tags
+// and the profile has declared that its results only depend on tags
+void OsmLuaProcessing::callLuaFunction(const char *functionName) {
+	if (!cacheResults) {
+		luaState[functionName](this);
+		return;
+	}
+
+	result_cache_key_t key(isRelation ? 'r' : isWay ? 'w' : 'n', currentTags);
+	auto cached = resultCache.find(key);
+	if (cached != resultCache.end()) {
+		// Replay the calls Lua made last time; geometry still comes from the current object,
+		// so if a layer gets no output here, its attributes and minimum zoom are skipped
+		bool added = false;
+		for (auto const &call: cached->second) {
+			size_t count = outputs.size();
+			switch (call.type) {
+				case LuaCall::Type::LAYER:             Layer(call.name, call.area); added = outputs.size() > count; break;
+				case LuaCall::Type::LAYER_AS_CENTROID: LayerAsCentroid(call.name); added = outputs.size() > count; break;
+				case LuaCall::Type::ATTRIBUTE:         if (added) addAttribute(call.name, call.value, call.minzoom); break;
+				case LuaCall::Type::MIN_ZOOM:          if (added) MinZoom(call.minzoom); break;
+			}
+		}
+		return;
+	}
+
+	calls.clear();
+	recording = true;
+	cacheable = true;
+	try {
+		luaState[functionName](this);
+	} catch (...) {
+		recording = false;
+		throw;
+	}
+	recording = false;
+
+	// Anything which depends on the ID or geometry (Area, Intersects...) can't be reused
+	if (cacheable) {
+		if (resultCache.size() >= MAX_RESULT_CACHE_SIZE) resultCache.clear();
+		resultCache.emplace(std::move(key), std::move(calls));
+	}
+}
+
+// Write all objects processed since the last commit to the shared stores
+void OsmLuaProcessing::commit() {
+	for (auto &object: pending) {
+		NodeID objectID = object.isRelation ? --newWayID : object.osmID;
+
+		for (auto &output: object.outputs) {
+			// Store the geometry and attributes of the generated output
+			AttributeStore::key_value_set_entry_t attributes;
+			for (auto const &kv: output.attributes) {
+				attributes.push_back(attributeStore.store_key_value(kv.key, kv.value, kv.minzoom));
+				setVectorLayerMetadata(output.layer, kv.key, metadataType(kv.value));
+			}
+			AttributeStoreRef attributeSet = attributeStore.store_set(attributes);
+
+			OSMStore::handle_t handle;
+			if (output.geomType==OutputGeometryType::POINT) {
+				handle = osmStore.store_point(osmStore.osm(), boost::get<Point>(output.geometry));
+			} else if (output.geomType==OutputGeometryType::LINESTRING) {
+				handle = osmStore.store_linestring(osmStore.osm(), boost::get<Linestring>(output.geometry));
+			} else {
+				handle = osmStore.store_multi_polygon(osmStore.osm(), boost::get<MultiPolygon>(output.geometry));
+			}
+			OutputObject outputObject(output.geomType, false, output.layer, objectID, handle, attributeSet);
+			outputObject.setMinZoom(output.minZoom);
+			outputObject.setValidGeometry(output.validGeometry);
+			OutputObjectRef oo = osmMemTiles.CreateObject(outputObject);
+
+			// Add it to each tile it covers
+			bool usePolygonTiles = output.geomType==OutputGeometryType::POLYGON && !object.polygonTiles.empty();
+			for (auto const &index: usePolygonTiles ? object.polygonTiles : object.tiles) {
+				osmMemTiles.AddObject(index, oo);
+			}
+		}
+	}
+	pending.clear();
+}
+
+// Queue the current object's outputs for commit()
+void OsmLuaProcessing::addPending(vector<TileCoordinates> &&tiles, vector<TileCoordinates> &&polygonTiles) {
+	pending.emplace_back();
+	PendingObject &object = pending.back();
+	object.osmID = isRelation ? 0 : osmID;
+	object.isRelation = isRelation;
+	object.tiles = std::move(tiles);
+	object.polygonTiles = std::move(polygonTiles);
+	object.outputs = std::move(outputs);
+	outputs.clear();
+}
+
 bool OsmLuaProcessing::canRemapShapefiles() {
 	return supportsRemappingShapefiles;
 }
@@ -93,6 +311,7 @@ kaguya::LuaTable OsmLuaProcessing::remapAttributes(kaguya::LuaTable& in_table, c
 
 // Get the ID of the current object
 string OsmLuaProcessing::Id() const {
+	cacheable = false;
 	return to_string(originalOsmID);
 }
 
@@ -108,10 +327,37 @@ string OsmLuaProcessing::Find(const string& key) const {
 	return it->second;
 }
 
+// ----	Allocation-free queries for the LuaJIT FFI bindings
+
+// Get the value of an OSM tag for a given key, or nullptr if none
+const string *OsmLuaProcessing::FindValue(const char *key, size_t length) const {
+	// currentTags is sorted, so we can binary search without making a std::string
+	auto it = lower_bound(currentTags.begin(), currentTags.end(), make_pair(key, length),
+		[](tag_map_t::value_type const &tag, pair<const char *, size_t> const &k) { return tag.first.compare(0, string::npos, k.first, k.second) < 0; });
+	if (it == currentTags.end() || it->first.compare(0, string::npos, key, length) != 0) return nullptr;
+	return &it->second;
+}
+
+// Get the number of a layer (or -1 if it doesn't exist)
+int OsmLuaProcessing::LayerId(const string &layerName) const {
+	auto layer = layers.layerMap.find(layerName);
+	return layer == layers.layerMap.end() ? -1 : static_cast<int>(layer->second);
+}
+
+// Intern an attribute key, returning its number
+uint OsmLuaProcessing::AttributeKeyId(const string &key) {
+	auto it = attributeKeyIds.find(key);
+	if (it != attributeKeyIds.end()) return it->second;
+	attributeKeys.push_back(key);
+	attributeKeyIds[key] = attributeKeys.size() - 1;
+	return attributeKeys.size() - 1;
+}
+
 // ----	Spatial queries called from Lua
 
 // Find intersecting shapefile layer
 vector<string> OsmLuaProcessing::FindIntersecting(const string &layerName) {
+	cacheable = false;
 	// TODO: multipolygon relations not supported, will always return empty vector
 	if(isRelation) return vector<string>();
 	Point p1(lon1/10000000.0,latp1/10000000.0);
@@ -121,6 +367,7 @@ vector<string> OsmLuaProcessing::FindIntersecting(const string &layerName) {
 }
 
 bool OsmLuaProcessing::Intersects(const string &layerName) {
+	cacheable = false;
 	// TODO: multipolygon relations not supported, will always return false
 	if(isRelation) return false;
 	Point p1(lon1/10000000.0,latp1/10000000.0);
@@ -131,6 +378,7 @@ bool OsmLuaProcessing::Intersects(const string &layerName) {
 
 // Returns whether it is closed polygon
 bool OsmLuaProcessing::IsClosed() const {
+	cacheable = false;
 	if (!isWay) return false; // nonsense: it isn't a way
 	if (isRelation) return true; // TODO: check it when non-multipolygon are supported
 	return isClosed;
@@ -142,6 +390,7 @@ void reverse_project(DegPoint& p) {
 
 // Returns area
 double OsmLuaProcessing::Area() {
+	cacheable = false;
 	if (!IsClosed()) return 0;
 
 #if BOOST_VERSION >= 106700
@@ -178,6 +427,7 @@ double OsmLuaProcessing::Area() {
 
 // Returns length
 double OsmLuaProcessing::Length() {
+	cacheable = false;
 	if (isWay) {
 		geom::model::linestring<DegPoint> l;
 		geom::assign(l, linestringCached());
@@ -228,22 +478,31 @@ const MultiPolygon &OsmLuaProcessing::multiPolygonCached() {
 
 // Add object to specified layer from Lua
 void OsmLuaProcessing::Layer(const string &layerName, bool area) {
-	if (layers.layerMap.count(layerName) == 0) {
+	auto layer = layers.layerMap.find(layerName);
+	if (layer == layers.layerMap.end()) {
 		throw out_of_range("ERROR: Layer(): a layer named as \"" + layerName + "\" doesn't exist.");
 	}
+	LayerWithId(layer->second, area);
+}
+
+void OsmLuaProcessing::LayerWithId(uint layer, bool area) {
+	if (layer >= layers.layers.size()) {
+		throw out_of_range("ERROR: Layer(): there is no layer " + to_string(layer));
+	}
+	if (recording) calls.push_back({ LuaCall::Type::LAYER, layers.layers[layer].name, area, {}, 0 });
+	size_t count = outputs.size();
+	addLayerOutput(layer, area);
+	// (if there's no output - e.g. the geometry is invalid - the result depends on more than the tags)
+	if (outputs.size() == count) cacheable = false;
+}
 
+void OsmLuaProcessing::addLayerOutput(uint layer, bool area) {
 	OutputGeometryType geomType = isWay ? (area ? OutputGeometryType::POLYGON : OutputGeometryType::LINESTRING) : OutputGeometryType::POINT;
 	try {
 		if (geomType==OutputGeometryType::POINT) {
 			LatpLon pt = indexStore->nodes_at(osmID);
 			Point p = Point(pt.lon, pt.latp);
-
-            CorrectGeometry(p);
-
-        	OutputObjectRef oo(new OutputObjectOsmStorePoint(geomType, false,
-	    	    			layers.layerMap[layerName],
-		    	    		osmID, osmStore.store_point(osmStore.osm(), p), attributeStore.empty_set()));
-    	    outputs.push_back(std::make_pair(oo, AttributeStore::key_value_set_entry_t()));
+			outputs.push_back({ geomType, static_cast<uint_least8_t>(layer), 0, p, {}, true });
             return;
 		}
 		else if (geomType==OutputGeometryType::POLYGON) {
@@ -268,34 +527,45 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 				mp.push_back(p);
 			}
 
-            CorrectGeometry(mp);
+			// Repair the geometry now, once, so that tiles can rely on it
+			bool valid = makeValid(mp);
+			if (!valid && verbose) cout << (isRelation ? "Relation " : "Way ") << originalOsmID << " is invalid and couldn't be repaired" << endl;
+			if (mp.empty()) return;
 
-            OutputObjectRef oo(new OutputObjectOsmStoreMultiPolygon(geomType, false,
-                            layers.layerMap[layerName],
-                            osmID, osmStore.store_multi_polygon(osmStore.osm(), mp), attributeStore.empty_set()));
-    	    outputs.push_back(std::make_pair(oo, AttributeStore::key_value_set_entry_t()));
+			outputs.push_back({ geomType, static_cast<uint_least8_t>(layer), 0, std::move(mp), {}, valid });
 		}
 		else if (geomType==OutputGeometryType::LINESTRING) {
 			// linestring
 			Linestring ls = linestringCached();
 
-            CorrectGeometry(ls);
+			if (!makeValid(ls)) return;
 
-    	    OutputObjectRef oo(new OutputObjectOsmStoreLinestring(geomType, false,
-		    			layers.layerMap[layerName],
-			    		osmID, osmStore.store_linestring(osmStore.osm(), ls), attributeStore.empty_set()));
-    	    outputs.push_back(std::make_pair(oo, AttributeStore::key_value_set_entry_t()));
+			outputs.push_back({ geomType, static_cast<uint_least8_t>(layer), 0, std::move(ls), {}, true });
 		}
 	} catch (std::invalid_argument &err) {
-		cerr << "Error in OutputObjectOsmStore constructor: " << err.what() << endl;
+		cerr << "Error in OutputObject constructor: " << err.what() << endl;
 	}
 }
 
 void OsmLuaProcessing::LayerAsCentroid(const string &layerName) {
-	if (layers.layerMap.count(layerName) == 0) {
+	auto layer = layers.layerMap.find(layerName);
+	if (layer == layers.layerMap.end()) {
 		throw out_of_range("ERROR: LayerAsCentroid(): a layer named as \"" + layerName + "\" doesn't exist.");
 	}
+	LayerAsCentroidWithId(layer->second);
+}
+
+void OsmLuaProcessing::LayerAsCentroidWithId(uint layer) {
+	if (layer >= layers.layers.size()) {
+		throw out_of_range("ERROR: LayerAsCentroid(): there is no layer " + to_string(layer));
+	}
+	if (recording) calls.push_back({ LuaCall::Type::LAYER_AS_CENTROID, layers.layers[layer].name, false, {}, 0 });
+	size_t count = outputs.size();
+	addCentroidOutput(layer);
+	if (outputs.size() == count) cacheable = false;
+}
 
+void OsmLuaProcessing::addCentroidOutput(uint layer) {
     Point centroid, geomp;
 	try {
 
@@ -327,14 +597,11 @@ void OsmLuaProcessing::LayerAsCentroid(const string &layerName) {
 		cerr << "Problem geometry " << (isRelation ? "relation " : isWay ? "way " : "node " ) << originalOsmID << ": " << err.what() << endl;
 		return;
 	} catch (std::invalid_argument &err) {
-		cerr << "Error in OutputObjectOsmStore constructor for " << (isRelation ? "relation " : isWay ? "way " : "node " ) << originalOsmID << ": " << err.what() << endl;
+		cerr << "Error in OutputObject constructor for " << (isRelation ? "relation " : isWay ? "way " : "node " ) << originalOsmID << ": " << err.what() << endl;
 		return;
 	}
 
-	OutputObjectRef oo(new OutputObjectOsmStorePoint(OutputGeometryType::POINT,
-					false, layers.layerMap[layerName],
-					osmID, osmStore.store_point(osmStore.osm(), geomp), attributeStore.empty_set()));
-    outputs.push_back(std::make_pair(oo, AttributeStore::key_value_set_entry_t()));
+	outputs.push_back({ OutputGeometryType::POINT, static_cast<uint_least8_t>(layer), 0, geomp, {}, true });
 }
 
 // Set attributes in a vector tile's Attributes table
@@ -344,8 +611,7 @@ void OsmLuaProcessing::AttributeWithMinZoom(const string &key, const string &val
 	if (outputs.size()==0) { cerr << "Can't add Attribute " << key << " if no Layer set" << endl; return; }
 	vector_tile::Tile_Value v;
 	v.set_string_value(val);
-	outputs.back().second.push_back(attributeStore.store_key_value(key, v, minzoom));
-	setVectorLayerMetadata(outputs.back().first->layer, key, 0);
+	addAttribute(key, v, minzoom);
 }
 
 void OsmLuaProcessing::AttributeNumeric(const string &key, const float val) { AttributeNumericWithMinZoom(key,val,0); }
@@ -353,8 +619,7 @@ void OsmLuaProcessing::AttributeNumericWithMinZoom(const string &key, const floa
 	if (outputs.size()==0) { cerr << "Can't add Attribute " << key << " if no Layer set" << endl; return; }
 	vector_tile::Tile_Value v;
 	v.set_float_value(val);
-	outputs.back().second.push_back(attributeStore.store_key_value(key, v, minzoom));
-	setVectorLayerMetadata(outputs.back().first->layer, key, 1);
+	addAttribute(key, v, minzoom);
 }
 
 void OsmLuaProcessing::AttributeBoolean(const string &key, const bool val) { AttributeBooleanWithMinZoom(key,val,0); }
@@ -362,14 +627,28 @@ void OsmLuaProcessing::AttributeBooleanWithMinZoom(const string &key, const bool
 	if (outputs.size()==0) { cerr << "Can't add Attribute " << key << " if no Layer set" << endl; return; }
 	vector_tile::Tile_Value v;
 	v.set_bool_value(val);
-	outputs.back().second.push_back(attributeStore.store_key_value(key, v, minzoom));
-	setVectorLayerMetadata(outputs.back().first->layer, key, 2);
+	addAttribute(key, v, minzoom);
+}
+
+// Set an attribute using a key from AttributeKeyId
+void OsmLuaProcessing::AttributeWithKeyId(uint keyId, vector_tile::Tile_Value const &value, const char minzoom) {
+	if (keyId >= attributeKeys.size()) { cerr << "Unknown Attribute key " << keyId << endl; return; }
+	if (outputs.size()==0) { cerr << "Can't add Attribute " << attributeKeys[keyId] << " if no Layer set" << endl; return; }
+	if (value.has_string_value() && value.string_value().empty()) { return; }		// don't set empty strings
+	addAttribute(attributeKeys[keyId], value, minzoom);
+}
+
+// Add an attribute to the most recent output (stored on commit)
+void OsmLuaProcessing::addAttribute(const string &key, vector_tile::Tile_Value const &value, const char minzoom) {
+	if (recording) calls.push_back({ LuaCall::Type::ATTRIBUTE, key, false, value, minzoom });
+	outputs.back().attributes.push_back({ key, value, minzoom });
 }
 
 // Set minimum zoom
 void OsmLuaProcessing::MinZoom(const unsigned z) {
 	if (outputs.size()==0) { cerr << "Can't set minimum zoom if no Layer set" << endl; return; }
-	outputs.back().first->setMinZoom(z);
+	if (recording) calls.push_back({ LuaCall::Type::MIN_ZOOM, string(), false, {}, static_cast<char>(z) });
+	outputs.back().minZoom = z;
 }
 
 // Record attribute name/type for vector_layers table
@@ -390,17 +669,9 @@ void OsmLuaProcessing::setNode(NodeID id, LatpLon node, const tag_map_t &tags) {
 	currentTags = tags;
 
 	//Start Lua processing for node
-	luaState["node_function"](this);
+	callLuaFunction("node_function");
 	if (!this->empty()) {
-
-		TileCoordinates index = latpLon2index(node, this->config.baseZoom);
-		for (auto jt = this->outputs.begin(); jt != this->outputs.end(); ++jt) {
-			
-			// Store the attributes of the generated geometry
-			jt->first->setAttributeSet(attributeStore.store_set(jt->second));		
-
-			osmMemTiles.AddObject(index, jt->first);
-		}
+		addPending({ latpLon2index(node, this->config.baseZoom) }, {});
 	}
 }
 
@@ -441,9 +712,7 @@ void OsmLuaProcessing::setWay(WayID wayId, OSMStore::handle_t handle, const tag_
 		luaState.setErrorHandler(kaguya::ErrorHandler::throwDefaultError);
 
 		//Start Lua processing for way
-		kaguya::LuaFunction way_function = luaState["way_function"];
-		kaguya::LuaRef ret = way_function(this);
-		assert(!ret);
+		callLuaFunction("way_function");
 	}
 
 	if (!this->empty()) {
@@ -452,42 +721,22 @@ void OsmLuaProcessing::setWay(WayID wayId, OSMStore::handle_t handle, const tag_
 		try {
 			auto const &nodeVecPtr = &indexStore->retrieve<WayStore::nodeid_vector_t>(nodeVecHandle);
 			insertIntermediateTiles(indexStore->nodeListLinestring(nodeVecPtr->cbegin(),nodeVecPtr->cend()), this->config.baseZoom, tileSet);
-
-			// then, for each tile, store the OutputObject for each layer
-			bool polygonExists = false;
-			for (auto it = tileSet.begin(); it != tileSet.end(); ++it) {
-				TileCoordinates index = *it;
-				for (auto jt = this->outputs.begin(); jt != this->outputs.end(); ++jt) {
-
-					// Store the attributes of the generated geometry
-					jt->first->setAttributeSet(attributeStore.store_set(jt->second));		
-
-					if (jt->first->geomType == OutputGeometryType::POLYGON) {
-						polygonExists = true;
-						continue;
-					}
-					osmMemTiles.AddObject(index, jt->first);
-				}
-			}
-
-			// for polygon, fill inner tiles
-			if (polygonExists) {
-				fillCoveredTiles(tileSet);
-				for (auto it = tileSet.begin(); it != tileSet.end(); ++it) {
-					TileCoordinates index = *it;
-					for (auto jt = this->outputs.begin(); jt != this->outputs.end(); ++jt) {
-
-						// Store the attributes of the generated geometry
-						jt->first->setAttributeSet(attributeStore.store_set(jt->second));		
-
-						if (jt->first->geomType != OutputGeometryType::POLYGON) continue;
-						osmMemTiles.AddObject(index, jt->first);
-					}
-				}
-			}
 		} catch(std::out_of_range &err) {
 			cerr << "Error calculating intermediate tiles: " << err.what() << endl;
+			outputs.clear();
+			return;
+		}
+		vector<TileCoordinates> tiles(tileSet.begin(), tileSet.end());
+
+		// for polygon, fill inner tiles
+		vector<TileCoordinates> polygonTiles;
+		for (auto const &output: outputs) {
+			if (output.geomType != OutputGeometryType::POLYGON) continue;
+			fillCoveredTiles(tileSet);
+			polygonTiles.assign(tileSet.begin(), tileSet.end());
+			break;
 		}
+		addPending(std::move(tiles), std::move(polygonTiles));
 	}
 }
 
@@ -496,7 +745,7 @@ void OsmLuaProcessing::setWay(WayID wayId, OSMStore::handle_t handle, const tag_
 //  we use decrementing positive IDs to give a bit more space for way IDs)
 void OsmLuaProcessing::setRelation(int64_t relationId, OSMStore::handle_t relationHandle, const tag_map_t &tags) {
 	reset();
-	osmID = --newWayID;
+	osmID = 0;	// assigned from newWayID on commit()
 	originalOsmID = relationId;
 	isWay = true;
 	isRelation = true;
@@ -515,7 +764,7 @@ void OsmLuaProcessing::setRelation(int64_t relationId, OSMStore::handle_t relati
 	bool ok = true;
 	if (ok) {
 		//Start Lua processing for relation
-		luaState["way_function"](this);
+		callLuaFunction("way_function");
 	}
 
 	if (!this->empty()) {								
@@ -526,6 +775,7 @@ void OsmLuaProcessing::setRelation(int64_t relationId, OSMStore::handle_t relati
 			mp = indexStore->wayListMultiPolygon(relation.first.cbegin(), relation.first.cend(), relation.second.cbegin(), relation.second.cend());
 		} catch(std::out_of_range &err) {
 			cout << "In relation " << originalOsmID << ": " << err.what() << endl;
+			outputs.clear();
 			return;
 		}		
 
@@ -541,16 +791,7 @@ void OsmLuaProcessing::setRelation(int64_t relationId, OSMStore::handle_t relati
 				tileSet.insert(tileSetTmp.begin(), tileSetTmp.end());
 			}
 		}
-
-		for (auto it = tileSet.begin(); it != tileSet.end(); ++it) {
-			TileCoordinates index = *it;
-			for (auto jt = this->outputs.begin(); jt != this->outputs.end(); ++jt) {
-				// Store the attributes of the generated geometry
-				jt->first->setAttributeSet(attributeStore.store_set(jt->second));		
-
-				osmMemTiles.AddObject(index, jt->first);
-			}
-		}
+		addPending(vector<TileCoordinates>(tileSet.begin(), tileSet.end()), {});
 	}
 }
 
@@ -558,3 +799,9 @@ vector<string> OsmLuaProcessing::GetSignificantNodeKeys() {
 	return luaState["node_keys"];
 }
 
+// Keys (or key=value pairs) that make a way or relation significant; empty if way_keys isn't set
+vector<string> OsmLuaProcessing::GetSignificantWayKeys() {
+	if (!luaState["way_keys"]) return vector<string>();
+	return luaState["way_keys"];
+}
+
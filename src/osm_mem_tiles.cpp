@@ -7,4 +7,5 @@ OsmMemTiles::OsmMemTiles(uint baseZoom)
 
 void OsmMemTiles::Clear() {
 	tileIndex.clear();
+	objects.clear();
 }
@@ -4,6 +4,8 @@
 
 #include "output_object.h"
 #include "helpers.h"
+#include "clip.h"
+#include "simplify.h"
 #include <iostream>
 using namespace std;
 namespace geom = boost::geometry;
@@ -30,43 +32,38 @@ std::ostream& operator<<(std::ostream& os, OutputGeometryType geomType)
 
 // Write attribute key/value pairs (dictionary-encoded)
 void OutputObject::writeAttributes(
-	vector<string> *keyList, 
-	vector<vector_tile::Tile_Value> *valueList, 
-	vector_tile::Tile_Feature *featurePtr,
+	AttributeStore const &attributeStore,
+	LayerDictionary &dictionary,
+	MvtFeature *featurePtr,
 	char zoom) const {
 
-	for(auto const &it: attributes->entries) {
-		if (it->minzoom > zoom) continue;
-
-		// Look for key
-		std::string const &key = it->key;
-		auto kt = find(keyList->begin(), keyList->end(), key);
-		if (kt != keyList->end()) {
-			uint32_t subscript = kt - keyList->begin();
-			featurePtr->add_tags(subscript);
-		} else {
-			uint32_t subscript = keyList->size();
-			keyList->push_back(key);
-			featurePtr->add_tags(subscript);
-		}
-		
-		// Look for value
-		vector_tile::Tile_Value const &value = it->value;
-		int subscript = findValue(valueList, value);
-		if (subscript>-1) {
-			featurePtr->add_tags(subscript);
-		} else {
-			uint32_t subscript = valueList->size();
-			valueList->push_back(value);
-			featurePtr->add_tags(subscript);
-		}
+	auto pairs = attributeStore.get_encoded_set(attributes, zoom);
+	for (auto it = pairs.first; it != pairs.second; it += 2) {
+		featurePtr->addTag(dictionary.keyIndex(it[0]));
+		featurePtr->addTag(dictionary.valueIndex(it[1]));
+	}
+}
+
+template<class MultiPolygonT>
+static void clipMultiPolygon(MultiPolygonT const &mp, Box const &box, MultiPolygon &out)
+{
+	for (auto const &poly: mp) {
+		if (clip::clipPolygon(poly, box, out)) continue;
 
-		//if(value.has_string_value())
-		//	std::cout << "Write attr: " << key << " " << value.string_value() << std::endl;	
+		// the polygon crosses the box edges several times, so needs a general overlay
+		Polygon clippingPolygon;
+		geom::convert(box, clippingPolygon);
+		try {
+			MultiPolygon clipped;
+			geom::intersection(poly, clippingPolygon, clipped);
+			for (auto &p: clipped) out.push_back(std::move(p));
+		} catch (geom::overlay_invalid_input_exception &err) {
+			std::cout << "Couldn't clip polygon (self-intersection)" << std::endl;
+		}
 	}
 }
 
-Geometry buildWayGeometry(OSMStore &osmStore, OutputObject const &oo, const TileBbox &bbox) 
+Geometry buildWayGeometry(OSMStore &osmStore, OutputObject const &oo, const TileBbox &bbox, ClipCache *clipCache) 
 {
 	switch(oo.geomType) {
 		case OutputGeometryType::POINT:
@@ -80,38 +77,118 @@ Geometry buildWayGeometry(OSMStore &osmStore, OutputObject const &oo, const Tile
 
 		case OutputGeometryType::LINESTRING:
 		{
+			auto const &ls = osmStore.retrieve<mmap::linestring_t>(oo.handle);
 			MultiLinestring out;
-			geom::intersection(osmStore.retrieve<mmap::linestring_t>(oo.handle), bbox.clippingBox, out);
+			if (!clipCache || ls.size() < ClipCache::MIN_POINTS) {
+				clip::clipLinestring(ls, bbox.clippingBox, out);
+				return out;
+			}
+
+			// clip from an ancestor tile's result if we have one
+			std::shared_ptr<const MultiLinestring> ancestor;
+			if (clipCache->find(oo.handle, bbox, ancestor)) {
+				for (auto const &part: *ancestor) clip::clipLinestring(part, bbox.clippingBox, out);
+			} else {
+				clip::clipLinestring(ls, bbox.clippingBox, out);
+			}
+			clipCache->add(oo.handle, bbox, out);
 			return out;
 		}
 
 		case OutputGeometryType::POLYGON:
 		{
 			auto const &mp = osmStore.retrieve<mmap::multi_polygon_t>(oo.handle);
+			MultiPolygon out;
+			if (!clipCache || geom::num_points(mp) < ClipCache::MIN_POINTS) {
+				clipMultiPolygon(mp, bbox.clippingBox, out);
+				return out;
+			}
 
-			Polygon clippingPolygon;
+			std::shared_ptr<const MultiPolygon> ancestor;
+			if (clipCache->find(oo.handle, bbox, ancestor)) {
+				clipMultiPolygon(*ancestor, bbox.clippingBox, out);
+			} else {
+				clipMultiPolygon(mp, bbox.clippingBox, out);
+			}
+			clipCache->add(oo.handle, bbox, out);
+			return out;
+		}
 
-			geom::convert(bbox.clippingBox, clippingPolygon);
-			if (!geom::intersects(mp, clippingPolygon)) { return MultiPolygon(); }
-			if (geom::within(mp, clippingPolygon)) { 
-				MultiPolygon out;
-				boost::geometry::assign(out, mp);
-				return out; 
+		default:
+			throw std::runtime_error("Invalid output geometry");
+	}
+}
+
+// Is the geometry bigger than a tile in either direction (so it's likely to be written in several)?
+template<class GeometryT>
+static bool largerThanTile(GeometryT const &geometry, const TileBbox &bbox, Box &envelope)
+{
+	geom::envelope(geometry, envelope);
+	return envelope.max_corner().x() - envelope.min_corner().x() > bbox.maxLon  - bbox.minLon ||
+	       envelope.max_corner().y() - envelope.min_corner().y() > bbox.maxLatp - bbox.minLatp;
+}
+
+// A level given as a length varies with latitude: use the one at the centre of the whole object,
+// so that it's simplified just once at each zoom
+static double objectSimplifyLevel(Box const &envelope, double simplifyLevel, double simplifyLength)
+{
+	if (simplifyLength <= 0) return simplifyLevel;
+	return meter2degp(simplifyLength, (envelope.min_corner().y() + envelope.max_corner().y()) / 2);
+}
+
+Geometry buildSimplifiedWayGeometry(OSMStore &osmStore, OutputObject const &oo, const TileBbox &bbox,
+	double simplifyLevel, double simplifyLength, SimplifyAlgorithm simplifyAlgorithm, SimplifyCache &simplifyCache, ClipCache *clipCache, bool &simplified)
+{
+	simplified = false;
+	Box envelope;
+	switch(oo.geomType) {
+		case OutputGeometryType::LINESTRING:
+		{
+			std::shared_ptr<const Linestring> ls;
+			if (!simplifyCache.find(bbox.zoom, oo.handle, oo.layer, ls)) {
+				auto const &source = osmStore.retrieve<mmap::linestring_t>(oo.handle);
+				if (!largerThanTile(source, bbox, envelope)) break;
+				Linestring simple(source.begin(), source.end());
+				simplify::simplifyLine(simple, objectSimplifyLevel(envelope, simplifyLevel, simplifyLength), simplifyAlgorithm);
+				ls = simplifyCache.add(bbox.zoom, oo.handle, oo.layer, std::make_shared<const Linestring>(std::move(simple)));
 			}
+			simplified = true;
+			MultiLinestring out;
+			clip::clipLinestring(*ls, bbox.clippingBox, out);
+			return out;
+		}
 
-			try {
-				MultiPolygon out;
-				geom::intersection(mp, clippingPolygon, out);
-				return out;
-			} catch (geom::overlay_invalid_input_exception &err) {
-				std::cout << "Couldn't clip polygon (self-intersection)" << std::endl;
-				return MultiPolygon(); // blank
+		case OutputGeometryType::POLYGON:
+		{
+			std::shared_ptr<const MultiPolygon> mp;
+			if (!simplifyCache.find(bbox.zoom, oo.handle, oo.layer, mp)) {
+				auto const &source = osmStore.retrieve<mmap::multi_polygon_t>(oo.handle);
+				if (!largerThanTile(source, bbox, envelope)) break;
+				double level = objectSimplifyLevel(envelope, simplifyLevel, simplifyLength);
+				// (polygons whose outer ring collapses are dropped, as are collapsed holes)
+				MultiPolygon simple;
+				for (auto const &poly: source) {
+					Polygon p;
+					p.outer().assign(poly.outer.begin(), poly.outer.end());
+					if (!simplify::simplifyRing(p.outer(), level, simplifyAlgorithm)) continue;
+					for (auto const &inner: poly.inners) {
+						Ring r(inner.begin(), inner.end());
+						if (simplify::simplifyRing(r, level, simplifyAlgorithm)) p.inners().push_back(std::move(r));
+					}
+					simple.push_back(std::move(p));
+				}
+				mp = simplifyCache.add(bbox.zoom, oo.handle, oo.layer, std::make_shared<const MultiPolygon>(std::move(simple)));
 			}
+			simplified = true;
+			MultiPolygon out;
+			clipMultiPolygon(*mp, bbox.clippingBox, out);
+			return out;
 		}
 
 		default:
-			throw std::runtime_error("Invalid output geometry");
+			break;
 	}
+	return buildWayGeometry(osmStore, oo, bbox, clipCache);
 }
 
 LatpLon buildNodeGeometry(OSMStore &osmStore, OutputObject const &oo, const TileBbox &bbox)
@@ -151,26 +228,13 @@ bool intersects(OSMStore &osmStore, OutputObject const &oo, Point const &p)
 	}
 }
 
-// Find a value in the value dictionary
-// (we can't easily use find() because of the different value-type encoding - 
-//	should be possible to improve this though)
-int OutputObject::findValue(vector<vector_tile::Tile_Value> *valueList, vector_tile::Tile_Value const &value) const {
-	for (size_t i=0; i<valueList->size(); i++) {
-		vector_tile::Tile_Value v = valueList->at(i);
-		if (v.has_string_value() && value.has_string_value() && v.string_value()==value.string_value()) { return i; }
-		if (v.has_float_value()  && value.has_float_value()  && v.float_value() ==value.float_value() ) { return i; }
-		if (v.has_bool_value()	 && value.has_bool_value()   && v.bool_value()  ==value.bool_value()	) { return i; }
-	}
-	return -1;
-}
-
 // Comparision functions
 
 bool operator==(const OutputObjectRef &x, const OutputObjectRef &y) {
 	return
 		x->layer == y->layer &&
 		x->geomType == y->geomType &&
-		x->attributes->id == y->attributes->id &&
+		x->attributes == y->attributes &&
 		x->objectID == y->objectID;
 }
 
@@ -183,8 +247,8 @@ bool operator<(const OutputObjectRef &x, const OutputObjectRef &y) {
 	if (x->layer > y->layer) return false;
 	if (x->geomType < y->geomType) return true;
 	if (x->geomType > y->geomType) return false;
-	if (x->attributes->id < y->attributes->id) return true;
-	if (x->attributes->id > y->attributes->id) return false;
+	if (x->attributes < y->attributes) return true;
+	if (x->attributes > y->attributes) return false;
 	if (x->objectID < y->objectID) return true;
 	return false;
 }
@@ -0,0 +1,203 @@
+#include "pmtiles.h"
+#include "helpers.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+
+// The header and root directory must fit in the first 16k, which readers fetch in one request
+const uint64_t HEADER_LENGTH = 127;
+const uint64_t ROOT_DIRECTORY_SPACE = 16384;
+
+PMTiles::PMTiles() : tempLength(0) {}
+
+PMTiles::~PMTiles() {
+	if (tempFile.is_open()) {
+		tempFile.close();
+		remove(tempFilename.c_str());
+	}
+}
+
+uint64_t PMTiles::zxyToTileID(uint8_t zoom, uint32_t x, uint32_t y) {
+	// tiles at lower zooms come first
+	uint64_t id = ((uint64_t(1) << (2*zoom)) - 1) / 3;
+
+	// then position along the Hilbert curve
+	for (uint64_t s = (uint64_t(1) << zoom) / 2; s > 0; s /= 2) {
+		uint64_t rx = (x & s) > 0;
+		uint64_t ry = (y & s) > 0;
+		id += s * s * ((3 * rx) ^ ry);
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s-1-x;
+				y = s-1-y;
+			}
+			swap(x, y);
+		}
+	}
+	return id;
+}
+
+// ---- Write tiles
+
+void PMTiles::openForWriting(string *filename) {
+	this->filename = *filename;
+	tempFilename = *filename + ".tmp";
+	tempFile.open(tempFilename, ios::in | ios::out | ios::trunc | ios::binary);
+	if (!tempFile) throw runtime_error("Couldn't open " + tempFilename);
+	tempLength = 0;
+}
+
+void PMTiles::saveTile(int zoom, int x, int y, string data) {
+	ContentKey key { hash<string>()(data), static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef*>(data.data()), data.size())), static_cast<uint32_t>(data.size()) };
+	uint64_t tileID = zxyToTileID(zoom, x, y);
+
+	lock_guard<mutex> lock(m);
+	auto it = contents.find(key);
+	if (it == contents.end()) {
+		// new contents, so append them
+		it = contents.emplace(key, make_pair(tempLength, key.length)).first;
+		tempFile.write(data.data(), data.size());
+		tempLength += data.size();
+	}
+	entries.push_back(Entry { tileID, it->second.first, it->second.second, 1 });
+}
+
+// ---- Close archive
+
+void PMTiles::closeForWriting(TilesetInfo const &info) {
+	sort(entries.begin(), entries.end(), [](Entry const &a, Entry const &b) { return a.tileID < b.tileID; });
+	tempFile.flush();
+
+	fstream out(filename, ios::out | ios::trunc | ios::binary);
+	if (!out) throw runtime_error("Couldn't open " + filename);
+	string padding(ROOT_DIRECTORY_SPACE, '\0');
+	out.write(padding.data(), padding.size());
+
+	// Copy the tile data in tile ID order, so that the archive is clustered. Tiles which share
+	// contents point at the same data, and runs of consecutive tiles are combined into one entry.
+	vector<Entry> directory;
+	unordered_map<uint64_t, uint64_t> newOffsets;	// offset in tempFile -> offset in tile data
+	uint64_t dataLength = 0;
+	string buffer;
+	for (auto const &entry: entries) {
+		uint64_t offset;
+		auto it = newOffsets.find(entry.offset);
+		if (it != newOffsets.end()) {
+			offset = it->second;
+		} else {
+			buffer.resize(entry.length);
+			tempFile.seekg(entry.offset);
+			tempFile.read(&buffer[0], entry.length);
+			out.write(buffer.data(), buffer.size());
+			offset = dataLength;
+			newOffsets[entry.offset] = offset;
+			dataLength += entry.length;
+		}
+
+		if (!directory.empty()) {
+			Entry &last = directory.back();
+			if (last.offset == offset && last.tileID + last.runLength == entry.tileID) {
+				last.runLength++;
+				continue;
+			}
+		}
+		directory.push_back(Entry { entry.tileID, offset, entry.length, 1 });
+	}
+	tempFile.close();
+	remove(tempFilename.c_str());
+
+	// Metadata
+	uint64_t metadataOffset = ROOT_DIRECTORY_SPACE + dataLength;
+	string metadata = compress_string(info.metadata, Z_DEFAULT_COMPRESSION, true);
+	out.write(metadata.data(), metadata.size());
+
+	// Directories: use just a root directory if it fits, otherwise split the entries into
+	// leaf directories, making them larger until the root directory (listing the leaves) fits
+	string root = serializeDirectory(directory.begin(), directory.end());
+	string leaves;
+	for (size_t leafSize = 4096; root.size() > ROOT_DIRECTORY_SPACE - HEADER_LENGTH; leafSize *= 2) {
+		vector<Entry> rootEntries;
+		leaves.clear();
+		for (size_t i = 0; i < directory.size(); i += leafSize) {
+			auto end = directory.begin() + min(i + leafSize, directory.size());
+			string leaf = serializeDirectory(directory.begin() + i, end);
+			rootEntries.push_back(Entry { directory[i].tileID, leaves.size(), static_cast<uint32_t>(leaf.size()), 0 });
+			leaves += leaf;
+		}
+		root = serializeDirectory(rootEntries.begin(), rootEntries.end());
+	}
+	uint64_t leafOffset = metadataOffset + metadata.size();
+	out.write(leaves.data(), leaves.size());
+
+	// Header and root directory
+	out.seekp(0);
+	out << serializeHeader(info, HEADER_LENGTH, root.size(), metadataOffset, metadata.size(), leafOffset, leaves.size(),
+		ROOT_DIRECTORY_SPACE, dataLength, entries.size(), directory.size(), newOffsets.size());
+	out << root;
+	out.close();
+
+	entries.clear();
+	contents.clear();
+}
+
+static void writeVarint(string &out, uint64_t value) {
+	while (value >= 0x80) {
+		out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+	out.push_back(static_cast<char>(value));
+}
+
+// Directory: number of entries, then each field for all entries in turn (tile IDs as deltas,
+// offsets as 0 if the data follows on from the previous entry, or offset+1), gzipped
+string PMTiles::serializeDirectory(vector<Entry>::const_iterator begin, vector<Entry>::const_iterator end) {
+	string out;
+	writeVarint(out, end - begin);
+	uint64_t lastID = 0;
+	for (auto it = begin; it != end; ++it) { writeVarint(out, it->tileID - lastID); lastID = it->tileID; }
+	for (auto it = begin; it != end; ++it) { writeVarint(out, it->runLength); }
+	for (auto it = begin; it != end; ++it) { writeVarint(out, it->length); }
+	for (auto it = begin; it != end; ++it) {
+		if (it != begin && it->offset == (it-1)->offset + (it-1)->length) writeVarint(out, 0);
+		else writeVarint(out, it->offset + 1);
+	}
+	return compress_string(out, Z_DEFAULT_COMPRESSION, true);
+}
+
+template<typename T>
+static void writeLittleEndian(string &out, T value) {
+	for (size_t i = 0; i < sizeof(T); i++) {
+		out.push_back(static_cast<char>(static_cast<uint64_t>(value) >> (8*i)));
+	}
+}
+
+string PMTiles::serializeHeader(TilesetInfo const &info, uint64_t rootOffset, uint64_t rootLength,
+	uint64_t metadataOffset, uint64_t metadataLength, uint64_t leafOffset, uint64_t leafLength,
+	uint64_t dataOffset, uint64_t dataLength, uint64_t addressedTiles, uint64_t tileEntries, uint64_t tileContents) {
+
+	auto e7 = [](double degrees) { return static_cast<int32_t>(lround(degrees * 10000000)); };
+	string out = "PMTiles";
+	out.push_back(3);							// version
+	for (uint64_t value: { rootOffset, rootLength, metadataOffset, metadataLength, leafOffset, leafLength,
+	                       dataOffset, dataLength, addressedTiles, tileEntries, tileContents }) {
+		writeLittleEndian(out, value);
+	}
+	out.push_back(1);							// clustered
+	out.push_back(2);							// internal compression: gzip
+	out.push_back(info.tileCompression);
+	out.push_back(1);							// tile type: MVT
+	out.push_back(info.minZoom);
+	out.push_back(info.maxZoom);
+	for (double degrees: { info.minLon, info.minLat, info.maxLon, info.maxLat }) {
+		writeLittleEndian(out, e7(degrees));
+	}
+	out.push_back(info.centerZoom);
+	writeLittleEndian(out, e7(info.centerLon));
+	writeLittleEndian(out, e7(info.centerLat));
+	return out;
+}
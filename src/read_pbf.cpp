@@ -3,13 +3,51 @@
 #include "pbf_blocks.h"
 
 #include <boost/interprocess/streams/bufferstream.hpp>
+#include <boost/asio/post.hpp>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
 
 using namespace std;
 
 PbfReader::PbfReader(OSMStore &osmStore)
 	: osmStore(osmStore)
+{ }
+
+void PbfReader::ProcessEntries(size_t count, function<void(PbfReaderOutput &, size_t)> const &process)
 {
-	output = nullptr;
+	size_t numOutputs = min(outputs.size(), count);
+	if (numOutputs <= 1) {
+		for (size_t i=0; i<count; i++) process(*outputs.front(), i);
+	} else {
+		if (!pool) pool.reset(new boost::asio::thread_pool(outputs.size()));
+
+		// Each output gets a contiguous chunk, so committing them in order preserves the input order
+		mutex m;
+		condition_variable cv;
+		size_t remaining = numOutputs;
+		exception_ptr error;
+		for (size_t t=0; t<numOutputs; t++) {
+			size_t start = count * t / numOutputs, end = count * (t+1) / numOutputs;
+			PbfReaderOutput &output = *outputs[t];
+			boost::asio::post(*pool, [&, start, end]() {
+				exception_ptr e;
+				try {
+					for (size_t i=start; i<end; i++) process(output, i);
+				} catch (...) {
+					e = current_exception();
+				}
+				lock_guard<mutex> lock(m);
+				if (e && !error) error = e;
+				if (--remaining == 0) cv.notify_one();
+			});
+		}
+		unique_lock<mutex> lock(m);
+		cv.wait(lock, [&]() { return remaining == 0; });
+		if (error) rethrow_exception(error);
+	}
+
+	for (auto output: outputs) output->commit();
 }
 
 bool PbfReader::ReadNodes(PrimitiveGroup &pg, PrimitiveBlock const &pb, const unordered_set<int> &nodeKeyPositions)
@@ -41,22 +79,28 @@ bool PbfReader::ReadNodes(PrimitiveGroup &pg, PrimitiveBlock const &pb, const un
 				}
 				kvPos++;
 			}
-			// For tagged nodes, call Lua, then save the OutputObject
+			// For tagged nodes, queue them for Lua
 			if (significant) {
-				boost::container::flat_map<std::string, std::string> tags;
+				tag_map_t tags;
 				for (uint n=kvStart; n<kvPos-1; n+=2) {
 					tags[pb.stringtable().s(dense.keys_vals(n))] = pb.stringtable().s(dense.keys_vals(n+1));
 				}
-
-				output->setNode(static_cast<NodeID>(nodeId), node, tags);
+				node_entries.push_back({ static_cast<NodeID>(nodeId), node, std::move(tags) });
 			}
 		}
+
+		// Call Lua, then save the OutputObjects
+		ProcessEntries(node_entries.size(), [&](PbfReaderOutput &output, size_t i) {
+			auto const &entry = node_entries[i];
+			output.setNode(entry.nodeId, entry.node, entry.tags);
+		});
+		node_entries.clear();
 		return true;
 	}
 	return false;
 }
 
-bool PbfReader::ReadWays(PrimitiveGroup &pg, PrimitiveBlock const &pb) {
+bool PbfReader::ReadWays(PrimitiveGroup &pg, PrimitiveBlock const &pb, const SignificantTagPositions &wayKeyPositions) {
 	// ----	Read ways
 
 	if (pg.ways_size() > 0) {
@@ -74,16 +118,19 @@ bool PbfReader::ReadWays(PrimitiveGroup &pg, PrimitiveBlock const &pb) {
 			}
 
 			try {
+				// Store the way's nodes in the global way store (relations may need it)
+				OSMStore::handle_t handle = osmStore.ways_insert_back(static_cast<WayID>(pbfWay.id()), nodeVec);
+
+				// Only ways with significant tags are queued for Lua
+				if (!isSignificant(pbfWay, wayKeyPositions)) continue;
+
 				auto keysPtr = pbfWay.mutable_keys();
 				auto valsPtr = pbfWay.mutable_vals();
-				boost::container::flat_map<std::string, std::string> tags;
+				tag_map_t tags;
 				for (uint n=0; n < pbfWay.keys_size(); n++) {
 					tags[pb.stringtable().s(keysPtr->Get(n))] = pb.stringtable().s(valsPtr->Get(n));
 				}
-
-				// Store the way's nodes in the global way store
-				OSMStore::handle_t handle = osmStore.ways_insert_back(static_cast<WayID>(pbfWay.id()), nodeVec);
-				output->setWay(static_cast<WayID>(pbfWay.id()), handle, tags);
+				way_entries.push_back({ wayId, handle, std::move(tags) });
 
 			} catch (std::out_of_range &err) {
 				// Way is missing a node?
@@ -91,12 +138,23 @@ bool PbfReader::ReadWays(PrimitiveGroup &pg, PrimitiveBlock const &pb) {
 			}
 
 		}
+
+		ProcessEntries(way_entries.size(), [&](PbfReaderOutput &output, size_t i) {
+			auto const &entry = way_entries[i];
+			try {
+				output.setWay(entry.wayId, entry.nodeVecHandle, entry.tags);
+			} catch (std::out_of_range &err) {
+				// Way is missing a node?
+				cerr << endl << err.what() << endl;
+			}
+		});
+		way_entries.clear();
 		return true;
 	}
 	return false;
 }
 
-bool PbfReader::ReadRelations(PrimitiveGroup &pg, PrimitiveBlock const &pb) {
+bool PbfReader::ReadRelations(PrimitiveGroup &pg, PrimitiveBlock const &pb, const SignificantTagPositions &wayKeyPositions) {
 	// ----	Read relations
 	//		(just multipolygons for now; we should do routes in time)
 
@@ -110,6 +168,7 @@ bool PbfReader::ReadRelations(PrimitiveGroup &pg, PrimitiveBlock const &pb) {
 				Relation pbfRelation = pg.relations(j);
 				if (find(pbfRelation.keys().begin(), pbfRelation.keys().end(), typeKey) == pbfRelation.keys().end()) { continue; }
 				if (find(pbfRelation.vals().begin(), pbfRelation.vals().end(), mpKey  ) == pbfRelation.vals().end()) { continue; }
+				if (!isSignificant(pbfRelation, wayKeyPositions)) { continue; }
 
 				// Read relation members
 				WayVec outerWayVec, innerWayVec;
@@ -127,7 +186,7 @@ bool PbfReader::ReadRelations(PrimitiveGroup &pg, PrimitiveBlock const &pb) {
 				try {
 					auto keysPtr = pbfRelation.mutable_keys();
 					auto valsPtr = pbfRelation.mutable_vals();
-					boost::container::flat_map<std::string, std::string> tags;
+					tag_map_t tags;
 					for (uint n=0; n < pbfRelation.keys_size(); n++) {
 						tags[pb.stringtable().s(keysPtr->Get(n))] = pb.stringtable().s(valsPtr->Get(n));
 
@@ -135,7 +194,7 @@ bool PbfReader::ReadRelations(PrimitiveGroup &pg, PrimitiveBlock const &pb) {
 
 					// Store the relation members in the global relation store
 	 				OSMStore::handle_t handle = osmStore.relations_insert_front(pbfRelation.id(), outerWayVec, innerWayVec);
-					output->setRelation(pbfRelation.id(), handle, tags);
+					relation_entries.push_back({ pbfRelation.id(), handle, std::move(tags) });
 
 				} catch (std::out_of_range &err) {
 					// Relation is missing a member?
@@ -143,13 +202,24 @@ bool PbfReader::ReadRelations(PrimitiveGroup &pg, PrimitiveBlock const &pb) {
 				}
 
 			}
+
+			ProcessEntries(relation_entries.size(), [&](PbfReaderOutput &output, size_t i) {
+				auto const &entry = relation_entries[i];
+				try {
+					output.setRelation(entry.relationId, entry.relationHandle, entry.tags);
+				} catch (std::out_of_range &err) {
+					// Relation is missing a member?
+					cerr << endl << err.what() << endl;
+				}
+			});
+			relation_entries.clear();
 		}
 		return true;
 	}
 	return false;
 }
 
-int PbfReader::ReadPbfFile(std::istream &infile, unordered_set<string> &nodeKeys)
+int PbfReader::ReadPbfFile(std::istream &infile, unordered_set<string> &nodeKeys, unordered_set<string> const &wayKeys)
 {
 	// ----	Read PBF
 	osmStore.clear();
@@ -171,6 +241,7 @@ int PbfReader::ReadPbfFile(std::istream &infile, unordered_set<string> &nodeKeys
 		for (auto it : nodeKeys) {
 			nodeKeyPositions.insert(findStringPosition(pb, it.c_str()));
 		}
+		SignificantTagPositions wayKeyPositions = findSignificantTagPositions(pb, wayKeys);
 
 		for (int i=0; i<pb.primitivegroup_size(); i++) {
 			PrimitiveGroup pg;
@@ -181,10 +252,10 @@ int PbfReader::ReadPbfFile(std::istream &infile, unordered_set<string> &nodeKeys
 			bool done = ReadNodes(pg, pb, nodeKeyPositions);
 			if(done) continue;
 
-			done = ReadWays(pg, pb);
+			done = ReadWays(pg, pb, wayKeyPositions);
 			if(done) continue;
 
-			done = ReadRelations(pg, pb);
+			done = ReadRelations(pg, pb, wayKeyPositions);
 			if(done) continue;
 		}
 		ct++;
@@ -205,6 +276,23 @@ int PbfReader::findStringPosition(PrimitiveBlock const &pb, char const *str) {
 	return -1;
 }
 
+// Find the positions of significant keys ("key" or "key=value") in the dictionary
+PbfReader::SignificantTagPositions PbfReader::findSignificantTagPositions(PrimitiveBlock const &pb, unordered_set<string> const &keys) {
+	SignificantTagPositions positions;
+	positions.all = keys.empty();
+	for (auto const &it : keys) {
+		size_t eq = it.find('=');
+		if (eq == string::npos) {
+			positions.keys.insert(findStringPosition(pb, it.c_str()));
+		} else {
+			int key = findStringPosition(pb, it.substr(0, eq).c_str());
+			int val = findStringPosition(pb, it.substr(eq+1).c_str());
+			if (key>-1 && val>-1) positions.keyValues.insert(make_pair(key, val));
+		}
+	}
+	return positions;
+}
+
 // *************************************************
 
 int ReadPbfBoundingBox(const std::string &inputFile, double &minLon, double &maxLon, 
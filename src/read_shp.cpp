@@ -1,4 +1,5 @@
 #include "read_shp.h"
+#include "make_valid.h"
 
 using namespace std;
 namespace geom = boost::geometry;
@@ -243,22 +244,12 @@ void readShapefile(const Box &clippingBox,
 			multi.push_back(poly);
 			geom::remove_spikes(multi);
 
-			string reason;
-#if BOOST_VERSION >= 105800
-			if (!geom::is_valid(multi, reason)) {
-				cerr << "Shapefile entity #" << i << " type " << shapeType << " is invalid. Parts:" << shape->nParts << ". Reason:" << reason;
-				geom::correct(multi);
-				geom::remove_spikes(multi);	// water polygon shapefile has many spikes
-				if (geom::is_valid(multi, reason)) {
-					cerr << "... corrected";
-				} else {
-					cerr << "... failed to correct. Reason: " << reason;
-				}
-				cerr << endl;
+			// Repair the geometry now, once, so that tiles can rely on it
+			bool valid = makeValid(multi);
+			if (!valid) {
+				cerr << "Shapefile entity #" << i << " type " << shapeType << " is invalid and couldn't be repaired. Parts:" << shape->nParts << endl;
 			}
-#else
-			if (!geom::is_valid(multi)) { geom::correct(multi); geom::remove_spikes(multi); }
-#endif
+
 			// clip to bounding box
 			MultiPolygon out;
 			geom::intersection(multi, clippingBox, out);
@@ -271,6 +262,7 @@ void readShapefile(const Box &clippingBox,
 				// create OutputObject
 				auto &attributeStore = osmLuaProcessing.getAttributeStore();
 				OutputObjectRef oo = shpMemTiles.AddObject(layerNum, layerName, OutputGeometryType::POLYGON, out, isIndexed, hasName, name, attributeStore.empty_set());
+				oo->setValidGeometry(valid);
 
 				addShapefileAttributes(dbf, oo, i, columnMap, columnTypeMap, layers, osmLuaProcessing);
 			}
@@ -6,10 +6,11 @@
 using namespace std;
 using namespace rapidjson;
 
-SharedData::SharedData(Config &configIn, const class LayerDefinition &layers)
-	: layers(layers), config(configIn) {
+SharedData::SharedData(Config &configIn, const class LayerDefinition &layers, const AttributeStore &attributeStore)
+	: layers(layers), attributeStore(attributeStore), clipCache(configIn.endZoom), config(configIn) {
 	sqlite=false;
 	mergeSqlite=false;
+	pmtiles=false;
 }
 
 SharedData::~SharedData() { }
@@ -19,7 +20,8 @@ SharedData::~SharedData() { }
 // Define a layer (as read from the .json file)
 uint LayerDefinition::addLayer(string name, uint minzoom, uint maxzoom,
 		uint simplifyBelow, double simplifyLevel, double simplifyLength, double simplifyRatio, 
-		uint filterBelow, double filterArea, uint combinePolygonsBelow,
+		SimplifyAlgorithm simplifyAlgorithm,
+		uint filterBelow, double filterArea, uint combinePolygonsBelow, bool combineReversed,
 		const std::string &source,
 		const std::vector<std::string> &sourceColumns,
 		bool allSourceColumns,
@@ -27,8 +29,8 @@ uint LayerDefinition::addLayer(string name, uint minzoom, uint maxzoom,
 		const std::string &indexName,
 		const std::string &writeTo)  {
 
-	LayerDef layer = { name, minzoom, maxzoom, simplifyBelow, simplifyLevel, simplifyLength, simplifyRatio, 
-		filterBelow, filterArea, combinePolygonsBelow,
+	LayerDef layer = { name, minzoom, maxzoom, simplifyBelow, simplifyLevel, simplifyLength, simplifyRatio, simplifyAlgorithm,
+		filterBelow, filterArea, combinePolygonsBelow, combineReversed,
 		source, sourceColumns, allSourceColumns, indexed, indexName,
 		std::map<std::string,uint>() };
 	layers.push_back(layer);
@@ -99,6 +101,9 @@ Config::Config() {
 	clippingBoxFromJSON = false;
 	baseZoom = 0;
 	combineBelow = 0;
+	mbtilesBatchSize = 1000;
+	mbtilesFastBulk = false;
+	mbtilesDeduplicate = false;
 }
 
 Config::~Config() { }
@@ -133,6 +138,9 @@ void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, B
 	compressOpt    = jsonConfig["settings"]["compress"].GetString();
 	combineBelow   = jsonConfig["settings"].HasMember("combine_below") ? jsonConfig["settings"]["combine_below"].GetUint() : 0;
 	mvtVersion     = jsonConfig["settings"].HasMember("mvt_version") ? jsonConfig["settings"]["mvt_version"].GetUint() : 2;
+	mbtilesBatchSize = jsonConfig["settings"].HasMember("mbtiles_batch_size") ? jsonConfig["settings"]["mbtiles_batch_size"].GetUint() : 1000;
+	mbtilesFastBulk  = jsonConfig["settings"].HasMember("mbtiles_fast_bulk") ? jsonConfig["settings"]["mbtiles_fast_bulk"].GetBool() : false;
+	mbtilesDeduplicate = jsonConfig["settings"].HasMember("mbtiles_deduplicate") ? jsonConfig["settings"]["mbtiles_deduplicate"].GetBool() : false;
 	projectName    = jsonConfig["settings"]["name"].GetString();
 	projectVersion = jsonConfig["settings"]["version"].GetString();
 	projectDesc    = jsonConfig["settings"]["description"].GetString();
@@ -159,6 +167,7 @@ void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, B
 
 	// Check config is valid
 	if (endZoom > baseZoom) { cerr << "maxzoom must be the same or smaller than basezoom." << endl; exit (EXIT_FAILURE); }
+	if (mbtilesBatchSize == 0) { cerr << "mbtiles_batch_size must be at least 1." << endl; exit (EXIT_FAILURE); }
 	if (! compressOpt.empty()) {
 		if      (compressOpt == "gzip"   ) { gzip = true;  }
 		else if (compressOpt == "deflate") { gzip = false; }
@@ -182,9 +191,11 @@ void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, B
 		double simplifyLevel  = it->value.HasMember("simplify_level" ) ? it->value["simplify_level" ].GetDouble() : 0.01;
 		double simplifyLength = it->value.HasMember("simplify_length") ? it->value["simplify_length"].GetDouble() : 0.0;
 		double simplifyRatio  = it->value.HasMember("simplify_ratio" ) ? it->value["simplify_ratio" ].GetDouble() : 1.0;
+		string simplifyAlgo   = it->value.HasMember("simplify_algorithm") ? it->value["simplify_algorithm"].GetString() : "douglas-peucker";
 		int    filterBelow    = it->value.HasMember("filter_below"   ) ? it->value["filter_below"   ].GetInt()    : 0;
 		double filterArea     = it->value.HasMember("filter_area"    ) ? it->value["filter_area"    ].GetDouble() : 0.5;
 		int    combinePolyBelow=it->value.HasMember("combine_polygons_below") ? it->value["combine_polygons_below"].GetInt() : 0;
+		bool   combineReversed= it->value.HasMember("combine_reversed") ? it->value["combine_reversed"].GetBool() : false;
 		string source = it->value.HasMember("source") ? it->value["source"].GetString() : "";
 		vector<string> sourceColumns;
 		bool allSourceColumns = false;
@@ -202,9 +213,17 @@ void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, B
 		}
 		string indexName = it->value.HasMember("index_column") ? it->value["index_column"].GetString() : "";
 
+		SimplifyAlgorithm simplifyAlgorithm;
+		if      (simplifyAlgo == "douglas-peucker") { simplifyAlgorithm = SimplifyAlgorithm::DOUGLAS_PEUCKER; }
+		else if (simplifyAlgo == "visvalingam"    ) { simplifyAlgorithm = SimplifyAlgorithm::VISVALINGAM; }
+		else {
+			cerr << "\"simplify_algorithm\" should be \"douglas-peucker\" or \"visvalingam\" in layer " << layerName << "." << endl;
+			exit (EXIT_FAILURE);
+		}
+
 		layers.addLayer(layerName, minZoom, maxZoom,
-				simplifyBelow, simplifyLevel, simplifyLength, simplifyRatio, 
-				filterBelow, filterArea, combinePolyBelow,
+				simplifyBelow, simplifyLevel, simplifyLength, simplifyRatio, simplifyAlgorithm,
+				filterBelow, filterArea, combinePolyBelow, combineReversed,
 				source, sourceColumns, allSourceColumns, indexed, indexName,
 				writeTo);
 
@@ -77,8 +77,8 @@ OutputObjectRef ShpMemTiles::AddObject(uint_least8_t layerNum,
 		{
 			Point *p = boost::get<Point>(&geometry);
 			if (p != nullptr) {
-				oo = new OutputObjectOsmStorePoint(
-					geomType, true, layerNum, id, osmStore.store_point(osmStore.shp(), *p), attributes);
+				oo = CreateObject(OutputObject(
+					geomType, true, layerNum, id, osmStore.store_point(osmStore.shp(), *p), attributes));
 				cachedGeometries.push_back(oo);
 
 				tilex =  lon2tilex(p->x(), baseZoom);
@@ -89,8 +89,8 @@ OutputObjectRef ShpMemTiles::AddObject(uint_least8_t layerNum,
 
 		case OutputGeometryType::LINESTRING:
 		{
-			oo = new OutputObjectOsmStoreLinestring(
-						geomType, true, layerNum, id, osmStore.store_linestring(osmStore.shp(), boost::get<Linestring>(geometry)), attributes);
+			oo = CreateObject(OutputObject(
+						geomType, true, layerNum, id, osmStore.store_linestring(osmStore.shp(), boost::get<Linestring>(geometry)), attributes));
 			cachedGeometries.push_back(oo);
 
 			addToTileIndexPolyline(oo, &geometry);
@@ -98,8 +98,8 @@ OutputObjectRef ShpMemTiles::AddObject(uint_least8_t layerNum,
 
 		case OutputGeometryType::POLYGON:
 		{
-			oo = new OutputObjectOsmStoreMultiPolygon(
-						geomType, true, layerNum, id, osmStore.store_multi_polygon(osmStore.shp(), boost::get<MultiPolygon>(geometry)), attributes);
+			oo = CreateObject(OutputObject(
+						geomType, true, layerNum, id, osmStore.store_multi_polygon(osmStore.shp(), boost::get<MultiPolygon>(geometry)), attributes));
 			cachedGeometries.push_back(oo);
 			
 			// add to tile index
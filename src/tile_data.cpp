@@ -5,52 +5,96 @@ using namespace std;
 
 typedef std::pair<OutputObjectsConstIt,OutputObjectsConstIt> OutputObjectsConstItPair;
 
-void TileDataSource::MergeTileCoordsAtZoom(uint zoom, uint baseZoom, const TileIndex &srcTiles, TileCoordinatesSet &dstCoords) {
-	if (zoom==baseZoom) {
-		// at z14, we can just use tileIndex
-		for (auto it = srcTiles.begin(); it!= srcTiles.end(); ++it) {
-			TileCoordinates index = it->first;
-			dstCoords.insert(index);
-		}
-	} else {
-		// otherwise, we need to run through the z14 list, and assign each way
-		// to a tile at our zoom level
-		for (auto it = srcTiles.begin(); it!= srcTiles.end(); ++it) {
-			TileCoordinates index = it->first;
-			TileCoordinate tilex = index.x / pow(2, baseZoom-zoom);
-			TileCoordinate tiley = index.y / pow(2, baseZoom-zoom);
-			TileCoordinates newIndex(tilex, tiley);
-			dstCoords.insert(newIndex);
+void TileDataSource::SortIndex() {
+	if (tileIndexSorted) return;
+	sort(tileIndex.begin(), tileIndex.end());
+	// an object may have been added to the same tile more than once
+	tileIndex.erase(unique(tileIndex.begin(), tileIndex.end(), [](TileIndexEntry const &a, TileIndexEntry const &b) {
+		return a.tile == b.tile && a.oo == b.oo;
+	}), tileIndex.end());
+	tileIndexSorted = true;
+}
+
+void TileDataSource::MergeTileCoordsAtZooms(uint startZoom, uint endZoom, uint baseZoom, const TileIndex &srcTiles, vector<vector<uint64_t>> &dstTiles) {
+	// The index is in Morton order, so the tiles at every zoom level come out in order too,
+	// and we can collect all zoom levels in a single pass, adding each tile when it changes
+	vector<vector<uint64_t>> tiles(endZoom+1);
+	for (auto const &entry: srcTiles) {
+		for (int zoom=endZoom; zoom>=static_cast<int>(startZoom); zoom--) {
+			uint64_t tile = entry.tile >> (2 * (baseZoom-zoom));
+			// if the tile hasn't changed at this zoom, it hasn't changed at lower zooms either
+			if (!tiles[zoom].empty() && tiles[zoom].back() == tile) break;
+			tiles[zoom].push_back(tile);
 		}
 	}
+
+	// Merge with the tiles from other sources
+	for (uint zoom=startZoom; zoom<=endZoom; zoom++) {
+		vector<uint64_t> &dst = dstTiles[zoom];
+		size_t middle = dst.size();
+		dst.insert(dst.end(), tiles[zoom].begin(), tiles[zoom].end());
+		inplace_merge(dst.begin(), dst.begin() + middle, dst.end());
+		dst.erase(unique(dst.begin(), dst.end()), dst.end());
+	}
 }
 
-void TileDataSource::MergeSingleTileDataAtZoom(TileCoordinates dstIndex, uint zoom, uint baseZoom, const TileIndex &srcTiles, std::vector<OutputObjectRef> &dstTile) {
-	if (zoom==baseZoom) {
-		// at z14, we can just use tileIndex
-		auto oosetIt = srcTiles.find(dstIndex);
-		if(oosetIt == srcTiles.end()) return;
-		dstTile.insert(dstTile.end(), oosetIt->second.begin(), oosetIt->second.end());
-	} else {
-		// otherwise, we need to run through the z14 list, and assign each way
-		// to a tile at our zoom level
-		int scale = pow(2, baseZoom-zoom);
-		TileCoordinates srcIndex1(dstIndex.x*scale, dstIndex.y*scale);
-		TileCoordinates srcIndex2((dstIndex.x+1)*scale, (dstIndex.y+1)*scale);
-
-		for(int x=srcIndex1.x; x<srcIndex2.x; x++)
-		{
-			for(int y=srcIndex1.y; y<srcIndex2.y; y++)
-			{
-				TileCoordinates srcIndex(x, y);
-				auto oosetIt = srcTiles.find(srcIndex);
-				if(oosetIt == srcTiles.end()) continue;
-				for (auto it = oosetIt->second.begin(); it != oosetIt->second.end(); ++it) {
-					OutputObjectRef oo = *it;
-					if (oo->minZoom > zoom) continue;
-					dstTile.insert(dstTile.end(), oo);
-				}
-			}
-		}
+size_t TileDataSource::CountObjectsAtZoom(TileCoordinates dstIndex, uint zoom) const {
+	uint shift = 2 * (baseZoom-zoom);
+	auto tileLess = [](TileIndexEntry const &entry, uint64_t tile) { return entry.tile < tile; };
+	auto begin = lower_bound(tileIndex.begin(), tileIndex.end(), tile2morton(dstIndex) << shift, tileLess);
+	auto end   = lower_bound(begin, tileIndex.end(), (tile2morton(dstIndex)+1) << shift, tileLess);
+	return end - begin;
+}
+
+void TileDataSource::CollectTileDataAtZoom(TileCoordinates dstIndex, uint zoom, uint baseZoom, const TileIndex &srcTiles, std::vector<TileIndexRun> &dstRuns) {
+	// All the z14 tiles within our tile are a contiguous range of the index
+	uint shift = 2 * (baseZoom-zoom);
+	uint64_t first = tile2morton(dstIndex) << shift;
+	uint64_t last  = ((tile2morton(dstIndex)+1) << shift) - 1;
+	auto it = lower_bound(srcTiles.begin(), srcTiles.end(), first, [](TileIndexEntry const &entry, uint64_t tile) {
+		return entry.tile < tile;
+	});
+	while (it != srcTiles.end() && it->tile <= last) {
+		auto runBegin = it;
+		while (it != srcTiles.end() && it->tile == runBegin->tile) ++it;
+		dstRuns.emplace_back(runBegin, it);
+	}
+}
+
+vector<OutputObjectRef> GetTileData(vector<class TileDataSource *> const &sources, TileCoordinates coordinates, unsigned int zoom) {
+	vector<TileIndexRun> runs;
+	for (size_t i=0; i<sources.size(); i++)
+		sources[i]->CollectTileDataAtZoom(coordinates, zoom, runs);
+
+	// Each run is already sorted, so do a k-way merge using a heap of runs (smallest object on top).
+	// An object appears once for each base zoom tile it covers: equal objects come out together,
+	// so we only keep the first.
+	auto later = [](TileIndexRun const &x, TileIndexRun const &y) { return y.first->oo < x.first->oo; };
+	make_heap(runs.begin(), runs.end(), later);
+
+	vector<OutputObjectRef> data;
+	while (!runs.empty()) {
+		pop_heap(runs.begin(), runs.end(), later);
+		TileIndexRun &run = runs.back();
+		OutputObjectRef const &oo = run.first->oo;
+		if (oo->minZoom <= zoom && (data.empty() || !(data.back() == oo)))
+			data.push_back(oo);
+
+		if (++run.first == run.second) runs.pop_back();
+		else push_heap(runs.begin(), runs.end(), later);
+	}
+	return data;
+}
+
+vector<TileCoordinatesList> GetTileCoordinates(vector<class TileDataSource *> const &sources, unsigned int startZoom, unsigned int endZoom) {
+	vector<vector<uint64_t>> tiles(endZoom+1);
+	for (size_t i=0; i<sources.size(); i++)
+		sources[i]->MergeTileCoordsAtZooms(startZoom, endZoom, tiles);
+
+	vector<TileCoordinatesList> tileCoordinates(endZoom+1);
+	for (uint zoom=startZoom; zoom<=endZoom; zoom++) {
+		tileCoordinates[zoom].reserve(tiles[zoom].size());
+		for (uint64_t tile: tiles[zoom]) tileCoordinates[zoom].push_back(morton2tile(tile));
 	}
+	return tileCoordinates;
 }
@@ -1,77 +1,177 @@
 /*! \file */ 
 #include "tile_worker.h"
 #include <fstream>
+#include <deque>
+#include <unordered_map>
 #include <boost/filesystem.hpp>
 #include "helpers.h"
 #include "write_geometry.h"
+#include "clip.h"
+#include "make_valid.h"
 using namespace std;
 extern bool verbose;
 
-typedef std::pair<double,double> xy_pair;
-
-// Connect disconnected linestrings within a MultiLinestring
-void ReorderMultiLinestring(MultiLinestring &input, MultiLinestring &output) {
-	// create a map of the start/end points of each linestring
-	// (we should be able to do std::map<Point,unsigned>, but that errors)
-	std::map<xy_pair,unsigned> startPoints;
-	std::map<xy_pair,unsigned> endPoints;
+// Connect disconnected linestrings within a MultiLinestring, wherever one ends in the tile pixel
+// that another starts in. If joinReversed, lines can also be turned round to join them (for layers
+// where the direction of a line doesn't matter).
+void ReorderMultiLinestring(MultiLinestring &input, MultiLinestring &output, const TileBbox &bbox, bool joinReversed) {
+	// index the start and end points of each linestring by pixel: entry 2i is the start of line i, 2i+1 its end
+	auto pixel = [&](Point const &p) {
+		pair<int,int> xy = bbox.scaleLatpLon(p.y(), p.x());
+		return (uint64_t(uint32_t(xy.first)) << 32) | uint32_t(xy.second);
+	};
+	unordered_multimap<uint64_t,unsigned> endpoints;
+	endpoints.reserve(input.size()*2);
 	for (unsigned i=0; i<input.size(); i++) {
-		startPoints[xy_pair(input[i][0].x(),input[i][0].y())] = i;
-		endPoints[xy_pair(input[i][input[i].size()-1].x(),input[i][input[i].size()-1].y())] = i;
+		if (input[i].empty()) continue;
+		endpoints.emplace(pixel(input[i].front()), 2*i);
+		endpoints.emplace(pixel(input[i].back() ), 2*i+1);
 	}
+	vector<bool> added(input.size(), false);
+
+	// find an unused line with its start (or end, if wantEnd) at this pixel - or the other end if
+	// joinReversed and there's no better match. Returns the entry, or -1.
+	auto findJoin = [&](uint64_t key, bool wantEnd) {
+		auto range = endpoints.equal_range(key);
+		int64_t reversed = -1;
+		for (auto it = range.first; it != range.second; ++it) {
+			unsigned entry = it->second;
+			if (added[entry/2]) continue;
+			if ((entry%2 == 1) == wantEnd) return int64_t(entry);
+			if (joinReversed && reversed < 0) reversed = entry;
+		}
+		return reversed;
+	};
 
-	// then for each linestring:
-	// [skip if it's already been handled]
-	// 1. create an output linestring from it
-	// 2. look to see if there's another linestring which starts at our end point, or terminates at our start point
-	// 3. if there is, then append it, remove from the map, and repeat from 2
-	std::vector<bool> added(input.size(), false);
 	for (unsigned i=0; i<input.size(); i++) {
-		if (added[i]) continue;
-		Linestring ls = std::move(input[i]);
+		if (added[i] || input[i].empty()) continue;
 		added[i] = true;
-		while (true) {
-			Point lastPoint = ls[ls.size()-1];
-			auto foundStart = startPoints.find(xy_pair(lastPoint.x(),lastPoint.y()));
-			if (foundStart != startPoints.end()) {
-				unsigned idx = foundStart->second;
-				if (!added[idx]) {
-					ls.insert(ls.end(), input[idx].begin()+1, input[idx].end());
-					added[idx] = true;
-					continue;
-				}
-			}
 
-			Point firstPoint = ls[0];
-			auto foundEnd = endPoints.find(xy_pair(firstPoint.x(),firstPoint.y()));
-			if (foundEnd != endPoints.end()) {
-				unsigned idx = foundEnd->second;
-				if (!added[idx]) {
-					ls.insert(ls.begin(), input[idx].begin(), input[idx].end()-1);
-					added[idx] = true;
-					continue;
-				}
-			}
+		// build a chain of (line, reversed), extending it forwards and then backwards
+		deque<pair<unsigned,bool>> chain(1, make_pair(i, false));
+		uint64_t head = pixel(input[i].front()), tail = pixel(input[i].back());
+		int64_t entry;
+		while ((entry = findJoin(tail, false)) >= 0) {
+			unsigned j = entry/2;
+			bool reversed = entry%2 == 1;
+			added[j] = true;
+			chain.emplace_back(j, reversed);
+			tail = pixel(reversed ? input[j].front() : input[j].back());
+		}
+		while ((entry = findJoin(head, true)) >= 0) {
+			unsigned j = entry/2;
+			bool reversed = entry%2 == 0;
+			added[j] = true;
+			chain.emplace_front(j, reversed);
+			head = pixel(reversed ? input[j].back() : input[j].front());
+		}
 
-			break;
+		// then put the linestring together in one go
+		size_t points = 1;
+		for (auto const &link : chain) points += input[link.first].size() - 1;
+		Linestring ls;
+		ls.reserve(points);
+		for (auto const &link : chain) {
+			Linestring const &part = input[link.first];
+			size_t skip = ls.empty() ? 0 : 1;			// (the join point is already there)
+			if (link.second) ls.insert(ls.end(), part.rbegin()+skip, part.rend());
+			else             ls.insert(ls.end(), part.begin() +skip, part.end());
 		}
-		output.resize(output.size()+1);
-		output[output.size()-1] = std::move(ls);
+		output.push_back(move(ls));
 	}
 }
 
+// Build an object's geometry for this tile. If simplifying, large objects come back already
+// simplified (see buildSimplifiedWayGeometry), and simplified is set.
+Geometry BuildTileGeometry(OSMStore &osmStore, OutputObject const &oo, SharedData &sharedData, double simplifyLevel,
+	SimplifyAlgorithm simplifyAlgorithm, const TileBbox &bbox, bool &simplified) {
+
+	if (simplifyLevel > 0) {
+		// (simplifyLevel is for this tile's latitude: the whole object is simplified at its own)
+		const LayerDef &ld = sharedData.layers.layers[oo.layer];
+		double simplifyLength = ld.simplifyLength > 0 ? ld.simplifyLength * pow(ld.simplifyRatio, (ld.simplifyBelow-1) - bbox.zoom) : 0.0;
+		return buildSimplifiedWayGeometry(osmStore, oo, bbox, simplifyLevel, simplifyLength, simplifyAlgorithm, sharedData.simplifyCache, &sharedData.clipCache, simplified);
+	}
+	simplified = false;
+	return buildWayGeometry(osmStore, oo, bbox, &sharedData.clipCache);
+}
+
+// Round a point to the tile pixel it's written at (the small fraction keeps it there when the
+// writer truncates)
+inline void SnapToPixel(Point &p, const TileBbox &bbox) {
+	p.x(bbox.minLon  + (round((p.x() - bbox.minLon ) / bbox.xscale) + 0.001) * bbox.xscale);
+	p.y(bbox.maxLatp - (round((bbox.maxLatp - p.y()) / bbox.yscale) + 0.001) * bbox.yscale);
+}
+
+// Snap polygons to pixels. Edges shared by neighbouring polygons then coincide exactly, which
+// makes merging them quicker and more robust. Returns false if a ring isn't simple any more.
+bool SnapToPixels(MultiPolygon &mp, const TileBbox &bbox) {
+	auto snap = [&](Ring &ring) {
+		for (auto &p: ring) SnapToPixel(p, bbox);
+		simplify::removeRepeated(ring);
+		return simplify::isSimpleRing(ring);
+	};
+	for (auto &poly: mp) {
+		if (!snap(poly.outer())) return false;
+		for (auto &inner: poly.inners()) {
+			if (!snap(inner)) return false;
+		}
+	}
+	return true;
+}
+
+// Merge linestrings which have the same attributes into one. They're snapped to pixels, so that
+// where one ends and another starts, the points coincide exactly; ReorderMultiLinestring then joins them.
+void MergeGeometries(std::vector<MultiLinestring> &parts, const TileBbox &bbox, MultiLinestring &output) {
+	for (auto &part: parts) {
+		for (auto &ls: part) {
+			for (auto &p: ls) SnapToPixel(p, bbox);
+			simplify::removeRepeated(ls);
+			if (ls.size() > 1) output.push_back(std::move(ls));
+		}
+	}
+}
+
+// Polygons are merged with a cascaded union in tile pixels, except any which stop being simple
+// when snapped (which are just put alongside)
+void MergeGeometries(std::vector<MultiPolygon> &parts, const TileBbox &bbox, MultiPolygon &output) {
+	std::vector<MultiPolygon> mergeable;
+	MultiPolygon unmerged;
+	for (auto &part: parts) {
+		if (SnapToPixels(part, bbox)) {
+			mergeable.push_back(std::move(part));
+		} else {
+			// (its points are only moved within the pixel they're written at, so it's written just the same)
+			unmerged.insert(unmerged.end(), part.begin(), part.end());
+		}
+	}
+	MultiPolygon merged;
+	cascadedUnion(mergeable, merged);
+	output.insert(output.end(), merged.begin(), merged.end());
+	output.insert(output.end(), unmerged.begin(), unmerged.end());
+}
+
 template <typename T>
 void CheckNextObjectAndMerge(OSMStore &osmStore, OutputObjectsConstIt &jt, OutputObjectsConstIt ooSameLayerEnd, 
-	const TileBbox &bbox, T &g) {
+	SharedData &sharedData, double simplifyLevel, SimplifyAlgorithm simplifyAlgorithm, const TileBbox &bbox, T &g, bool &simplified) {
 
 	// If a object is a linestring/polygon that is followed by
 	// other linestrings/polygons with the same attributes,
-	// the following objects are merged into the first object, by taking union of geometries.
+	// the following objects are merged into the first object.
+	// We collect all their geometries first, then merge them in one go.
 	OutputObjectRef oo = *jt;
 	OutputObjectRef ooNext;
 	if(jt+1 != ooSameLayerEnd) ooNext = *(jt+1);
 
 	OutputGeometryType gt = oo->geomType;
+	std::vector<T> parts;		// to merge
+	T unmerged;					// put alongside: only polygons checked as valid can be trusted in an overlay
+	auto add = [&](T &geometry, OutputObject const &object) {
+		if (gt != OutputGeometryType::POLYGON || object.validGeometry) parts.push_back(std::move(geometry));
+		else unmerged.insert(unmerged.end(), std::make_move_iterator(geometry.begin()), std::make_move_iterator(geometry.end()));
+	};
+	OutputObjectRef first = oo;
+	bool merging = false;
 	while (jt+1 != ooSameLayerEnd &&
 			ooNext->geomType == gt &&
 			ooNext->attributes == oo->attributes) {
@@ -81,39 +181,51 @@ void CheckNextObjectAndMerge(OSMStore &osmStore, OutputObjectsConstIt &jt, Outpu
 		else ooNext.reset();
 
 		try {
-			T to_merge = boost::get<T>(buildWayGeometry(osmStore, *oo, bbox));
-			T output;
-			geom::union_(g, to_merge, output);
-			g = move(output);
+			bool mergeSimplified;
+			T to_merge = boost::get<T>(BuildTileGeometry(osmStore, *oo, sharedData, simplifyLevel, simplifyAlgorithm, bbox, mergeSimplified));
+			if (to_merge.empty()) continue;
+			if (!merging) {
+				add(g, *first);
+				merging = true;
+			}
+			add(to_merge, *oo);
+			simplified = simplified && mergeSimplified;
 		} catch (std::out_of_range &err) { cerr << "Geometry out of range " << gt << ": " << oo->objectID <<"," << err.what() << endl;
 		} catch (boost::bad_get &err) { cerr << "Type error while processing " << gt << ": " << oo->objectID << endl;
 		}
 	}
+	if (!merging) return;
+	g.clear();
+	MergeGeometries(parts, bbox, g);
+	g.insert(g.end(), std::make_move_iterator(unmerged.begin()), std::make_move_iterator(unmerged.end()));
 }
 
 void ProcessObjects(OSMStore &osmStore, OutputObjectsConstIt ooSameLayerBegin, OutputObjectsConstIt ooSameLayerEnd, 
-	class SharedData &sharedData, double simplifyLevel, double filterArea, bool combinePolygons, unsigned zoom, const TileBbox &bbox,
-	vector_tile::Tile_Layer *vtLayer, vector<string> &keyList, vector<vector_tile::Tile_Value> &valueList) {
+	class SharedData &sharedData, double simplifyLevel, SimplifyAlgorithm simplifyAlgorithm, double filterArea, bool combinePolygons, bool combineReversed, unsigned zoom, const TileBbox &bbox,
+	MvtWriter &writer, LayerDictionary &dictionary) {
 
+	MvtFeature feature;
 	for (auto jt = ooSameLayerBegin; jt != ooSameLayerEnd; ++jt) {
 		OutputObjectRef oo = *jt;
 		if (zoom < oo->minZoom) { continue; }
 
+		feature.clear();
 		if (oo->geomType == OutputGeometryType::POINT) {
-			vector_tile::Tile_Feature *featurePtr = vtLayer->add_features();
 			LatpLon pos = buildNodeGeometry(osmStore, *oo, bbox);
-			featurePtr->add_geometry(9);					// moveTo, repeat x1
+			feature.addGeometry(9);					// moveTo, repeat x1
 			pair<int,int> xy = bbox.scaleLatpLon(pos.latp/10000000.0, pos.lon/10000000.0);
-			featurePtr->add_geometry((xy.first  << 1) ^ (xy.first  >> 31));
-			featurePtr->add_geometry((xy.second << 1) ^ (xy.second >> 31));
-			featurePtr->set_type(vector_tile::Tile_GeomType_POINT);
+			feature.addGeometry((xy.first  << 1) ^ (xy.first  >> 31));
+			feature.addGeometry((xy.second << 1) ^ (xy.second >> 31));
+			feature.setType(vector_tile::Tile_GeomType_POINT);
 
-			oo->writeAttributes(&keyList, &valueList, featurePtr, zoom);
-			if (sharedData.config.includeID) { featurePtr->set_id(oo->objectID); }
+			oo->writeAttributes(sharedData.attributeStore, dictionary, &feature, zoom);
+			if (sharedData.config.includeID) { feature.setId(oo->objectID); }
+			writer.addFeature(feature);
 		} else {
 			Geometry g;
+			bool simplified;
 			try {
-				g = buildWayGeometry(osmStore, *oo, bbox);
+				g = BuildTileGeometry(osmStore, *oo, sharedData, simplifyLevel, simplifyAlgorithm, bbox, simplified);
 			} catch (std::out_of_range &err) {
 				if (verbose) cerr << "Error while processing geometry " << oo->geomType << "," << oo->objectID <<"," << err.what() << endl;
 				continue;
@@ -125,47 +237,41 @@ void ProcessObjects(OSMStore &osmStore, OutputObjectsConstIt ooSameLayerBegin, O
 
 			//This may increment the jt iterator
 			if (oo->geomType == OutputGeometryType::LINESTRING && zoom < sharedData.config.combineBelow) {
-				CheckNextObjectAndMerge(osmStore, jt, ooSameLayerEnd, bbox, boost::get<MultiLinestring>(g));
+				CheckNextObjectAndMerge(osmStore, jt, ooSameLayerEnd, sharedData, simplifyLevel, simplifyAlgorithm, bbox, boost::get<MultiLinestring>(g), simplified);
 				MultiLinestring reordered;
-				ReorderMultiLinestring(boost::get<MultiLinestring>(g), reordered);
+				ReorderMultiLinestring(boost::get<MultiLinestring>(g), reordered, bbox, combineReversed);
 				g = move(reordered);
 				oo = *jt;
 			} else if (oo->geomType == OutputGeometryType::POLYGON && combinePolygons) {
-				CheckNextObjectAndMerge(osmStore, jt, ooSameLayerEnd, bbox, boost::get<MultiPolygon>(g));
+				CheckNextObjectAndMerge(osmStore, jt, ooSameLayerEnd, sharedData, simplifyLevel, simplifyAlgorithm, bbox, boost::get<MultiPolygon>(g), simplified);
 				oo = *jt;
 			}
 
-			vector_tile::Tile_Feature *featurePtr = vtLayer->add_features();
-			WriteGeometryVisitor w(&bbox, featurePtr, simplifyLevel);
+			// (if merged with objects which weren't simplified in advance, the result is simplified here)
+			WriteGeometryVisitor w(&bbox, &feature, simplified ? 0.0 : simplifyLevel, simplifyAlgorithm);
 			boost::apply_visitor(w, g);
-			if (featurePtr->geometry_size()==0) { vtLayer->mutable_features()->RemoveLast(); continue; }
-			oo->writeAttributes(&keyList, &valueList, featurePtr, zoom);
-			if (sharedData.config.includeID) { featurePtr->set_id(oo->objectID); }
-
+			if (feature.empty()) { continue; }
+			oo->writeAttributes(sharedData.attributeStore, dictionary, &feature, zoom);
+			if (sharedData.config.includeID) { feature.setId(oo->objectID); }
+			writer.addFeature(feature);
 		}
 	}
 }
 
-vector_tile::Tile_Layer* findLayerByName(vector_tile::Tile &tile, std::string &layerName, vector<string> &keyList, vector<vector_tile::Tile_Value> &valueList) {
-	for (unsigned i=0; i<tile.layers_size(); i++) {
-		if (tile.layers(i).name()!=layerName) continue;
-		// we already have this layer, so copy the key/value lists, and return it
-		for (unsigned j=0; j<tile.layers(i).keys_size(); j++) keyList.emplace_back(tile.layers(i).keys(j));
-		for (unsigned j=0; j<tile.layers(i).values_size(); j++) valueList.emplace_back(tile.layers(i).values(j));
-		return tile.mutable_layers(i);
-	}
-	// not found, so add new layer
-	return tile.add_layers();
-}
-
+// Write a layer (made up of one or more sub-layers) into the tile. If we're merging with an
+// existing tile, existingLayer is that tile's layer of the same name: we add to its features.
 void ProcessLayer(OSMStore &osmStore,
-    TileCoordinates index, uint zoom, std::vector<OutputObjectRef> const &data, vector_tile::Tile &tile, 
-	const TileBbox &bbox, const std::vector<uint> &ltx, SharedData &sharedData)
+    TileCoordinates index, uint zoom, std::vector<OutputObjectRef> const &data, MvtWriter &writer,
+	const TileBbox &bbox, const std::vector<uint> &ltx, SharedData &sharedData, vector_tile::Tile_Layer const *existingLayer)
 {
-	vector<string> keyList;
-	vector<vector_tile::Tile_Value> valueList;
+	LayerDictionary dictionary(sharedData.attributeStore);
 	std::string layerName = sharedData.layers.layers[ltx.at(0)].name;
-	vector_tile::Tile_Layer *vtLayer = sharedData.mergeSqlite ? findLayerByName(tile, layerName, keyList, valueList) : tile.add_layers();
+	writer.startLayer();
+	if (existingLayer) {
+		for (auto const &key: existingLayer->keys()) dictionary.addExisting(key);
+		for (auto const &value: existingLayer->values()) dictionary.addExisting(value);
+		for (auto const &feature: existingLayer->features()) writer.addFeature(feature);
+	}
 
 	//TileCoordinate tileX = index.x;
 	TileCoordinate tileY = index.y;
@@ -194,55 +300,110 @@ void ProcessLayer(OSMStore &osmStore,
 		auto ooListSameLayer = GetObjectsAtSubLayer(data, layerNum);
 		// Loop through output objects
 		ProcessObjects(osmStore, ooListSameLayer.first, ooListSameLayer.second, sharedData, 
-			simplifyLevel, filterArea, zoom < ld.combinePolygonsBelow, zoom, bbox, vtLayer, keyList, valueList);
+			simplifyLevel, ld.simplifyAlgorithm, filterArea, zoom < ld.combinePolygonsBelow, ld.combineReversed, zoom, bbox, writer, dictionary);
 	}
 
-	// If there are any objects, then add tags
-	if (vtLayer->features_size()>0) {
-		vtLayer->set_name(layerName);
-		vtLayer->set_version(sharedData.config.mvtVersion);
-		vtLayer->set_extent(4096);
-		for (uint j=vtLayer->keys_size(); j<keyList.size(); j++) {
-			vtLayer->add_keys(keyList[j]);
-		}
-		for (uint j=vtLayer->values_size(); j<valueList.size(); j++) { 
-			vector_tile::Tile_Value *v = vtLayer->add_values();
-			*v = valueList[j];
-		}
-	} else {
-		tile.mutable_layers()->RemoveLast();
+	// (layers without any features aren't written)
+	writer.endLayer(layerName, sharedData.config.mvtVersion, 4096, dictionary.keys, dictionary.values);
+}
+
+// Does the polygon cover the tile's clipping box? Only if classifying its rings can't tell us do
+// we need the full test, which can be slow on a polygon with millions of points.
+template<class MultiPolygonT>
+bool CoversTile(MultiPolygonT const &mp, const TileBbox &bbox) {
+	clip::Coverage coverage = clip::coversBox(mp, bbox.clippingBox);
+	if (coverage != clip::Coverage::UNKNOWN) { return coverage == clip::Coverage::COVERS; }
+	Polygon clippingPolygon;
+	geom::convert(bbox.clippingBox, clippingPolygon);
+	return geom::covered_by(clippingPolygon, mp);
+}
+
+// If the only object visible in a tile is a polygon which covers the whole tile, return it
+OutputObjectRef FindCoveringPolygon(OSMStore &osmStore, SharedData &sharedData, std::vector<OutputObjectRef> const &data, uint zoom, const TileBbox &bbox)
+{
+	OutputObjectRef found;
+	for (auto const &oo: data) {
+		const LayerDef &ld = sharedData.layers.layers[oo->layer];
+		if (zoom<ld.minzoom || zoom>ld.maxzoom || zoom<oo->minZoom) { continue; }
+		// (small areas might be filtered out, and a simplified polygon might not cover the tile any
+		// more, so we can't take a short cut at those zooms)
+		if (found || oo->geomType != OutputGeometryType::POLYGON || !oo->validGeometry || zoom < ld.filterBelow || zoom < ld.simplifyBelow) { return OutputObjectRef(); }
+		found = oo;
+	}
+	if (!found) { return found; }
+
+	// (a large polygon may already be clipped to an ancestor tile, which is much quicker to test)
+	std::shared_ptr<const MultiPolygon> ancestor;
+	if (sharedData.clipCache.find(found->handle, bbox, ancestor)) {
+		return CoversTile(*ancestor, bbox) ? found : OutputObjectRef();
 	}
+	return CoversTile(osmStore.retrieve<mmap::multi_polygon_t>(found->handle), bbox) ? found : OutputObjectRef();
 }
 
 bool outputProc(boost::asio::thread_pool &pool, SharedData &sharedData, OSMStore &osmStore, std::vector<OutputObjectRef> const &data, TileCoordinates coordinates, uint zoom)
 {
-	// Create tile
-	vector_tile::Tile tile;
 	TileBbox bbox(coordinates, zoom);
 	if (sharedData.config.clippingBoxFromJSON && (sharedData.config.maxLon<=bbox.minLon 
 		|| sharedData.config.minLon>=bbox.maxLon || sharedData.config.maxLat<=bbox.minLat 
 		|| sharedData.config.minLat>=bbox.maxLat)) { return true; }
 
-	// Read existing tile if merging
-	if (sharedData.mergeSqlite) {
-		std::string rawTile;
-		if (sharedData.mbtiles.readTileAndUncompress(rawTile, zoom, bbox.index.x, bbox.index.y, sharedData.config.compress, sharedData.config.gzip)) {
-			tile.ParseFromString(rawTile);
-		}
+	// If the tile is entirely covered by one polygon (e.g. open sea), it's the same as every other
+	// such tile at this zoom, so we only need to build it once
+	string outputdata;
+	OutputObjectRef covering = sharedData.mergeSqlite ? OutputObjectRef() : FindCoveringPolygon(osmStore, sharedData, data, zoom, bbox);
+	decltype(sharedData.coveredTiles)::key_type coveredKey;
+	bool cached = false;
+	if (covering) {
+		coveredKey = make_tuple(zoom, uint_least8_t(covering->layer), covering->attributes, sharedData.config.includeID ? covering->objectID : 0);
+		std::lock_guard<std::mutex> lock(sharedData.coveredTilesMutex);
+		auto it = sharedData.coveredTiles.find(coveredKey);
+		if (it != sharedData.coveredTiles.end()) { outputdata = it->second; cached = true; }
 	}
 
-	// Loop through layers
-	for (auto lt = sharedData.layers.layerOrder.begin(); lt != sharedData.layers.layerOrder.end(); ++lt) {
-		ProcessLayer(osmStore, coordinates, zoom, data, tile, bbox, *lt, sharedData);
+	if (!cached) {
+		// Create tile (each thread reuses its writer, so that the buffers keep their memory)
+		thread_local MvtWriter writer;
+		writer.clear();
+		auto const &layerOrder = sharedData.layers.layerOrder;
+		vector<bool> written(layerOrder.size(), false);
+
+		// Read existing tile if merging: its layers stay in the same order, with ours added to any of the same name
+		if (sharedData.mergeSqlite) {
+			std::string rawTile;
+			vector_tile::Tile existing;
+			if (sharedData.mbtiles.readTileAndUncompress(rawTile, zoom, bbox.index.x, bbox.index.y, sharedData.config.compress, sharedData.config.gzip)) {
+				existing.ParseFromString(rawTile);
+			}
+			for (auto const &layer: existing.layers()) {
+				size_t i = 0;
+				while (i<layerOrder.size() && (written[i] || sharedData.layers.layers[layerOrder[i].at(0)].name != layer.name())) i++;
+				if (i == layerOrder.size()) { writer.addLayer(layer); continue; }
+				ProcessLayer(osmStore, coordinates, zoom, data, writer, bbox, layerOrder[i], sharedData, &layer);
+				written[i] = true;
+			}
+		}
+
+		// Loop through layers
+		for (size_t i=0; i<layerOrder.size(); i++) {
+			if (written[i]) continue;
+			ProcessLayer(osmStore, coordinates, zoom, data, writer, bbox, layerOrder[i], sharedData, nullptr);
+		}
+
+		if (sharedData.config.compress) { outputdata = compress_string(writer.data(), Z_DEFAULT_COMPRESSION, sharedData.config.gzip); }
+		else { outputdata = writer.data(); }
+
+		if (covering) {
+			std::lock_guard<std::mutex> lock(sharedData.coveredTilesMutex);
+			sharedData.coveredTiles.emplace(coveredKey, outputdata);
+		}
 	}
 
-	// Write to file or sqlite
-	string outputdata, compressed;
+	// Write to file, sqlite or PMTiles
 	if (sharedData.sqlite) {
-		// Write to sqlite
-		tile.SerializeToString(&outputdata);
-		if (sharedData.config.compress) { compressed = compress_string(outputdata, Z_DEFAULT_COMPRESSION, sharedData.config.gzip); }
-		sharedData.mbtiles.saveTile(zoom, bbox.index.x, bbox.index.y, sharedData.config.compress ? &compressed : &outputdata);
+		sharedData.mbtiles.saveTile(zoom, bbox.index.x, bbox.index.y, std::move(outputdata));
+
+	} else if (sharedData.pmtiles) {
+		sharedData.pmtilesFile.saveTile(zoom, bbox.index.x, bbox.index.y, std::move(outputdata));
 
 	} else {
 		// Write to file
@@ -251,15 +412,10 @@ bool outputProc(boost::asio::thread_pool &pool, SharedData &sharedData, OSMStore
 		filename << sharedData.outputFile << "/" << zoom << "/" << bbox.index.x << "/" << bbox.index.y << ".pbf";
 		boost::filesystem::create_directories(dirname.str());
 		fstream outfile(filename.str(), ios::out | ios::trunc | ios::binary);
-		if (sharedData.config.compress) {
-			tile.SerializeToString(&outputdata);
-			outfile << compress_string(outputdata, Z_DEFAULT_COMPRESSION, sharedData.config.gzip);
-		} else {
-			if (!tile.SerializeToOstream(&outfile)) { cerr << "Couldn't write to " << filename.str() << endl; return false; }
-		}
+		outfile << outputdata;
+		if (!outfile) { cerr << "Couldn't write to " << filename.str() << endl; return false; }
 		outfile.close();
 	}
 
 	return true;
 }
-
@@ -12,6 +12,7 @@
 #include <stdexcept>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <chrono>
 
 // Other utilities
@@ -82,12 +83,9 @@ void WriteSqliteMetadata(rapidjson::Document const &jsonConfig, SharedData &shar
 	sharedData.mbtiles.closeForWriting();
 }
 
-void WriteFileMetadata(rapidjson::Document const &jsonConfig, SharedData const &sharedData, LayerDefinition const &layers)
+// Build the metadata for file and PMTiles output (as in TileJSON)
+void GetFileMetadata(rapidjson::Document &document, rapidjson::Document const &jsonConfig, SharedData const &sharedData, LayerDefinition const &layers)
 {
-	if(sharedData.config.compress) 
-		std::cout << "When serving compressed tiles, make sure to include 'Content-Encoding: gzip' in your webserver configuration for serving pbf files"  << std::endl;
-
-	rapidjson::Document document;
 	document.SetObject();
 
 	if (jsonConfig["settings"].HasMember("filemetadata")) {
@@ -108,6 +106,15 @@ void WriteFileMetadata(rapidjson::Document const &jsonConfig, SharedData const &
 	document.AddMember("minzoom", rapidjson::Value(sharedData.config.startZoom), document.GetAllocator());
 	document.AddMember("maxzoom", rapidjson::Value(sharedData.config.endZoom), document.GetAllocator());
 	document.AddMember("vector_layers", layers.serialiseToJSONValue(document.GetAllocator()), document.GetAllocator());
+}
+
+void WriteFileMetadata(rapidjson::Document const &jsonConfig, SharedData const &sharedData, LayerDefinition const &layers)
+{
+	if(sharedData.config.compress) 
+		std::cout << "When serving compressed tiles, make sure to include 'Content-Encoding: gzip' in your webserver configuration for serving pbf files"  << std::endl;
+
+	rapidjson::Document document;
+	GetFileMetadata(document, jsonConfig, sharedData, layers);
 
 	auto fp = std::fopen((sharedData.outputFile + "/metadata.json").c_str(), "w");
 
@@ -119,63 +126,79 @@ void WriteFileMetadata(rapidjson::Document const &jsonConfig, SharedData const &
 	fclose(fp);
 }
 
-void generate_from_index(OSMStore &osmStore, PbfReaderOutput *output)
+void WritePMTilesMetadata(rapidjson::Document const &jsonConfig, SharedData &sharedData, LayerDefinition const &layers)
 {
-	PbfReaderOutput::tag_map_t currentTags;
-
-	std::cout << "Generate from index file" << std::endl;
-	for(std::size_t i = 0; i < osmStore.total_pbf_node_entries(); ++i) {
-		if((i + 1) % 10000 == 0) {
-			cout << "Generating node " << (i + 1) << " / " << osmStore.total_pbf_node_entries() << "        \r";
-			cout.flush();
-		}
-		auto const &entry = osmStore.pbf_node_entry(i);
-
-		currentTags.clear();
-		for(auto const &i: entry.tags) {
-			currentTags.emplace(std::piecewise_construct,
-				std::forward_as_tuple(i.first.begin(), i.first.end()), 
-				std::forward_as_tuple(i.second.begin(), i.second.end()));
-		}
+	rapidjson::Document document;
+	GetFileMetadata(document, jsonConfig, sharedData, layers);
+	rapidjson::StringBuffer strbuf;
+	rapidjson::Writer<rapidjson::StringBuffer> writer(strbuf);
+	document.Accept(writer);
 
-		output->setNode(entry.nodeId, entry.node, currentTags);
+	Config const &config = sharedData.config;
+	PMTiles::TilesetInfo info;
+	info.minZoom = config.startZoom;
+	info.maxZoom = config.endZoom;
+	info.minLon = config.minLon; info.minLat = config.minLat;
+	info.maxLon = config.maxLon; info.maxLat = config.maxLat;
+	info.centerLon = (config.minLon + config.maxLon) / 2;
+	info.centerLat = (config.minLat + config.maxLat) / 2;
+	info.centerZoom = config.startZoom;
+	if (!config.defaultView.empty()) {
+		string defaultView = config.defaultView;
+		vector<string> view = split_string(defaultView, ',');
+		info.centerLon = stod(view[0]); info.centerLat = stod(view[1]); info.centerZoom = stoi(view[2]);
 	}
+	info.tileCompression = config.compress ? 2 : 1;		// (deflate isn't allowed with PMTiles)
+	info.metadata = strbuf.GetString();
+	sharedData.pmtilesFile.closeForWriting(info);
+}
 
-	for(std::size_t i = 0; i < osmStore.total_pbf_way_entries(); ++i) {
-		if((i + 1) % 10000 == 0) {
-			cout << "Generating way " << (i + 1) << " / " <<  osmStore.total_pbf_way_entries()<< "        \r";
-			cout.flush();
-		}
-
-		auto const &entry = osmStore.pbf_way_entry(i);
-
-		currentTags.clear();
-		for(auto const &i: entry.tags) {
-			currentTags.emplace(std::piecewise_construct,
-				std::forward_as_tuple(i.first.begin(), i.first.end()), 
-				std::forward_as_tuple(i.second.begin(), i.second.end()));
-		}
-
-		output->setWay(entry.wayId, entry.nodeVecHandle, currentTags);
+template<class TagMap>
+void copyTags(PbfReaderOutput::tag_map_t &currentTags, TagMap const &tags)
+{
+	currentTags.clear();
+	for(auto const &i: tags) {
+		currentTags.emplace(std::piecewise_construct,
+			std::forward_as_tuple(i.first.begin(), i.first.end()), 
+			std::forward_as_tuple(i.second.begin(), i.second.end()));
 	}
+}
 
-	for(std::size_t i = 0; i < osmStore.total_pbf_relation_entries(); ++i) {
-		if((i + 1) == osmStore.total_pbf_relation_entries() || ((i + 1) % 100 == 0)) {
-			cout << "Generating relation " << (i + 1) << " / " << osmStore.total_pbf_relation_entries() << "        \r";
+void generate_from_index(OSMStore &osmStore, PbfReader &pbfReader)
+{
+	// Entries are sent to the outputs in batches, so that Lua processing can run in parallel
+	const std::size_t batchSize = 10000;
+	auto processEntries = [&](std::size_t total, char const *name, std::function<void(PbfReaderOutput &, std::size_t)> const &process) {
+		for(std::size_t start = 0; start < total; start += batchSize) {
+			std::size_t count = std::min(batchSize, total - start);
+			pbfReader.ProcessEntries(count, [&](PbfReaderOutput &output, std::size_t i) { process(output, start + i); });
+			cout << "Generating " << name << " " << (start + count) << " / " << total << "        \r";
 			cout.flush();
 		}
+	};
 
-		auto const &entry = osmStore.pbf_relation_entry(i);
+	std::cout << "Generate from index file" << std::endl;
+	processEntries(osmStore.total_pbf_node_entries(), "node", [&](PbfReaderOutput &output, std::size_t i) {
+		auto const &entry = osmStore.pbf_node_entry(i);
+		PbfReaderOutput::tag_map_t currentTags;
+		copyTags(currentTags, entry.tags);
+		output.setNode(entry.nodeId, entry.node, currentTags);
+	});
 
-		currentTags.clear();
-		for(auto const &i: entry.tags) {
-			currentTags.emplace(std::piecewise_construct,
-				std::forward_as_tuple(i.first.begin(), i.first.end()), 
-				std::forward_as_tuple(i.second.begin(), i.second.end()));
-		}
+	processEntries(osmStore.total_pbf_way_entries(), "way", [&](PbfReaderOutput &output, std::size_t i) {
+		auto const &entry = osmStore.pbf_way_entry(i);
+		PbfReaderOutput::tag_map_t currentTags;
+		copyTags(currentTags, entry.tags);
+		output.setWay(entry.wayId, entry.nodeVecHandle, currentTags);
+	});
 
-		output->setRelation(entry.relationId, entry.relationHandle, currentTags);
-	}
+	processEntries(osmStore.total_pbf_relation_entries(), "relation", [&](PbfReaderOutput &output, std::size_t i) {
+		auto const &entry = osmStore.pbf_relation_entry(i);
+		PbfReaderOutput::tag_map_t currentTags;
+		copyTags(currentTags, entry.tags);
+		output.setRelation(entry.relationId, entry.relationHandle, currentTags);
+	});
+	cout << endl;
 }
 
 /**
@@ -195,14 +218,14 @@ int main(int argc, char* argv[]) {
 	string jsonFile;
 	uint threadNum;
 	string outputFile;
-	bool _verbose = false, sqlite= false, mergeSqlite = false, mapsplit = false, osmStoreCompact = false;
+	bool _verbose = false, sqlite= false, pmtiles = false, mergeSqlite = false, mapsplit = false, osmStoreCompact = false;
 	bool index;
 
 	po::options_description desc("tilemaker (c) 2016-2020 Richard Fairhurst and contributors\nConvert OpenStreetMap .pbf files into vector tiles\n\nAvailable options");
 	desc.add_options()
 		("help",                                                                 "show help message")
 		("input",  po::value< vector<string> >(&inputFiles),                     "source .osm.pbf file")
-		("output", po::value< string >(&outputFile),                             "target directory or .mbtiles/.sqlite file")
+		("output", po::value< string >(&outputFile),                             "target directory or .mbtiles/.sqlite/.pmtiles file")
 		("index",  po::bool_switch(&index),                                      "generate an index file from the specified input file")
 		("merge"  ,po::bool_switch(&mergeSqlite),                                "merge with existing .mbtiles (overwrites otherwise)")
 		("config", po::value< string >(&jsonFile)->default_value("config.json"), "config JSON file")
@@ -228,6 +251,7 @@ int main(int argc, char* argv[]) {
 	if (vm.count("input")==0) { cout << "No source .osm.pbf file supplied" << endl; }
 
 	if (ends_with(outputFile, ".mbtiles") || ends_with(outputFile, ".sqlite")) { sqlite=true; }
+	if (ends_with(outputFile, ".pmtiles")) { pmtiles=true; }
 	if (threadNum == 0) { threadNum = max(thread::hardware_concurrency(), 1u); }
 	verbose = _verbose;
 
@@ -246,6 +270,9 @@ int main(int argc, char* argv[]) {
 			cerr << "Couldn't remove existing file" << endl;
 			return 0;
 		}
+	} else if (mergeSqlite && pmtiles) {
+		cout << "--merge can't be used with .pmtiles output, ignoring" << endl;
+		mergeSqlite = false;
 	} else if (mergeSqlite && !static_cast<bool>(std::ifstream(outputFile))) {
 		cout << "--merge specified but .mbtiles file doesn't already exist, ignoring" << endl;
 		mergeSqlite = false;
@@ -294,6 +321,12 @@ int main(int argc, char* argv[]) {
 		return -1;
 	}
 
+	// PMTiles only records gzip (or no) compression, so readers couldn't decode deflated tiles
+	if (pmtiles && config.compress && !config.gzip) {
+		cerr << "\"compress\": \"deflate\" can't be used with .pmtiles output: use \"gzip\" or \"none\"" << endl;
+		return -1;
+	}
+
 	uint storeNodesSize = 20;
 	uint storeWaysSize = 5;
 
@@ -341,8 +374,13 @@ int main(int argc, char* argv[]) {
 	class ShpMemTiles shpMemTiles(*osmStore, config.baseZoom);
 	class LayerDefinition layers(config.layers);
 
-	OsmLuaProcessing osmLuaProcessing(osmStore.get(), *osmStore, config, layers, luaFile, 
-		shpMemTiles, osmMemTiles, attributeStore);
+	// One Lua state per thread, so that OSM objects can be processed in parallel
+	vector<unique_ptr<OsmLuaProcessing>> luaProcessors;
+	for (uint i=0; i<threadNum; i++) {
+		luaProcessors.emplace_back(new OsmLuaProcessing(osmStore.get(), *osmStore, config, layers, luaFile, 
+			shpMemTiles, osmMemTiles, attributeStore));
+	}
+	OsmLuaProcessing &osmLuaProcessing = *luaProcessors.front();
 
 	// ---- Load external shp files
 
@@ -368,18 +406,20 @@ int main(int argc, char* argv[]) {
 
 	vector<string> nodeKeyVec = osmLuaProcessing.GetSignificantNodeKeys();
 	unordered_set<string> nodeKeys(nodeKeyVec.begin(), nodeKeyVec.end());
+	vector<string> wayKeyVec = osmLuaProcessing.GetSignificantWayKeys();
+	unordered_set<string> wayKeys(wayKeyVec.begin(), wayKeyVec.end());
 
 	// ----	Read all PBFs
 	
 	PbfReader pbfReader(*osmStore);
-	pbfReader.output = &osmLuaProcessing;
+	for (auto &processor: luaProcessors) pbfReader.outputs.push_back(processor.get());
 
 	std::unique_ptr<PbfIndexWriter> indexWriter;
 
 	if(index) {
 		std::cout << "Generating index file " << std::endl;
 		indexWriter.reset(new PbfIndexWriter(*osmStore));
-		pbfReader.output = indexWriter.get();
+		pbfReader.outputs = { indexWriter.get() };
 	}
 
 	if (!mapsplit) {
@@ -393,8 +433,8 @@ int main(int argc, char* argv[]) {
 	
 			std::cout << "Using index to generate tiles: " << indexfilename << std::endl;
 			indexStore->open(indexfilename, false);
-			osmLuaProcessing.setIndexStore(indexStore.get());
-			generate_from_index(*indexStore, &osmLuaProcessing);
+			for (auto &processor: luaProcessors) processor->setIndexStore(indexStore.get());
+			generate_from_index(*indexStore, pbfReader);
 		} else {
 			
 			for (auto inputFile : inputFiles) {
@@ -403,7 +443,7 @@ int main(int argc, char* argv[]) {
 				ifstream infile(inputFile, ios::in | ios::binary);
 				if (!infile) { cerr << "Couldn't open .pbf file " << inputFile << endl; return -1; }
 
-				int ret = pbfReader.ReadPbfFile(infile, nodeKeys);
+				int ret = pbfReader.ReadPbfFile(infile, nodeKeys, wayKeys);
 				if (ret != 0) return ret;
 			} 
 		}
@@ -414,18 +454,23 @@ int main(int argc, char* argv[]) {
 		return 0;
 	}
 
+	attributeStore.reportSize();
+
 	// ----	Initialise SharedData
 	std::vector<class TileDataSource *> sources = {&osmMemTiles, &shpMemTiles};
 
-	class SharedData sharedData(config, layers);
+	class SharedData sharedData(config, layers, attributeStore);
 	sharedData.outputFile = outputFile;
 	sharedData.sqlite = sqlite;
+	sharedData.pmtiles = pmtiles;
 	sharedData.mergeSqlite = mergeSqlite;
 
 	// ----	Initialise mbtiles if required
 	
 	if (sharedData.sqlite) {
-		sharedData.mbtiles.openForWriting(&sharedData.outputFile);
+		// (the fast bulk and deduplicated layouts can't be used to merge into an existing file)
+		sharedData.mbtiles.openForWriting(&sharedData.outputFile, sharedData.config.mbtilesBatchSize,
+			sharedData.config.mbtilesFastBulk && !mergeSqlite, sharedData.config.mbtilesDeduplicate && !mergeSqlite);
 		sharedData.mbtiles.writeMetadata("name",sharedData.config.projectName);
 		sharedData.mbtiles.writeMetadata("type","baselayer");
 		sharedData.mbtiles.writeMetadata("version",sharedData.config.projectVersion);
@@ -443,6 +488,8 @@ int main(int argc, char* argv[]) {
 		}
 		bounds << fixed << sharedData.config.minLon << "," << sharedData.config.minLat << "," << sharedData.config.maxLon << "," << sharedData.config.maxLat;
 		sharedData.mbtiles.writeMetadata("bounds",bounds.str());
+	} else if (sharedData.pmtiles) {
+		sharedData.pmtilesFile.openForWriting(&sharedData.outputFile);
 	}
 
 	// ----	Write out data
@@ -461,6 +508,7 @@ int main(int argc, char* argv[]) {
 
 		if (mapsplit) {
 			osmMemTiles.Clear();
+			sharedData.clipCache.clear();
 
 			tie(srcZ,srcX,tmsY) = tileList.back();
 			srcY = pow(2,srcZ) - tmsY - 1; // TMS
@@ -475,11 +523,15 @@ int main(int argc, char* argv[]) {
 			vector<char> pbf = mapsplitFile.readTile(srcZ,srcX,tmsY);
 
 			boost::interprocess::bufferstream pbfstream(pbf.data(), pbf.size(),  ios::in | ios::binary);
-			pbfReader.ReadPbfFile(pbfstream, nodeKeys);
+			pbfReader.ReadPbfFile(pbfstream, nodeKeys, wayKeys);
 
 			tileList.pop_back();
 		}
 
+		// Sort the tile indices, and encode the attribute sets, now that all objects have been added
+		for (auto source: sources) source->SortIndex();
+		attributeStore.encodeSets();
+
 		// Launch the pool with threadNum threads
 		boost::asio::thread_pool pool(threadNum);
 
@@ -490,8 +542,9 @@ int main(int argc, char* argv[]) {
 		std::size_t tc = 0;
 
 		std::deque< std::pair<unsigned int, TileCoordinates> > tile_coordinates;
+		auto all_zoom_result = GetTileCoordinates(sources, sharedData.config.startZoom, sharedData.config.endZoom);
 		for (uint zoom=sharedData.config.startZoom; zoom<=sharedData.config.endZoom; zoom++) {
-			auto zoom_result = GetTileCoordinates(sources, zoom);
+			auto &zoom_result = all_zoom_result[zoom];
 			for(auto&& it: zoom_result) {
 				// If we're constrained to a source tile, check we're within it
 				if (srcZ>-1) {
@@ -509,22 +562,47 @@ int main(int argc, char* argv[]) {
 			}
 		}
 
+		// Split the tiles into blocks of neighbouring tiles at the same zoom (they are in Morton order),
+		// so that each worker walks tiles which share geometries, and estimate the work in each block
+		struct TileBlock { std::size_t start, end, objects; };
+		std::vector<TileBlock> blocks;
 		std::size_t interval = 100;
-		for(std::size_t start_index = 0; start_index < tile_coordinates.size(); start_index += interval) {
-
-			boost::asio::post(pool, [=, &tile_coordinates, &pool, &sharedData, &osmStore, &io_mutex, &tc]() {
-				std::size_t end_index = std::min(tile_coordinates.size(), start_index + interval);
-				for(std::size_t i = start_index; i < end_index; ++i) {
-					unsigned int zoom = tile_coordinates[i].first;
-					TileCoordinates coords = tile_coordinates[i].second;
-					outputProc(pool, sharedData, *osmStore, GetTileData(sources, coords, zoom), coords, zoom);
-				}
-
-				const std::lock_guard<std::mutex> lock(io_mutex);
-				tc += (end_index - start_index); 
+		for (std::size_t i = 0; i < tile_coordinates.size(); ++i) {
+			unsigned int zoom = tile_coordinates[i].first;
+			if (blocks.empty() || blocks.back().end - blocks.back().start == interval || tile_coordinates[blocks.back().start].first != zoom)
+				blocks.push_back(TileBlock { i, i, 0 });
+			blocks.back().end = i + 1;
+			for (auto source: sources) blocks.back().objects += source->CountObjectsAtZoom(tile_coordinates[i].second, zoom);
+		}
 
-				unsigned int zoom = tile_coordinates[end_index - 1].first;
-				cout << "Zoom level " << zoom << ", writing tile " << tc << " of " << tile_coordinates.size() << "               \r" << std::flush;
+		// Dispatch the heaviest blocks first, so that the light ones fill in the gaps at the end
+		std::stable_sort(blocks.begin(), blocks.end(), [](TileBlock const &a, TileBlock const &b) { return a.objects > b.objects; });
+
+		// Count the tiles still to write at each zoom, so we know when to drop its simplified geometries
+		std::vector<std::atomic<std::size_t>> tilesLeft(sharedData.config.endZoom + 1);
+		for (auto &left: tilesLeft) left = 0;
+		for (auto const &block: blocks) tilesLeft[tile_coordinates[block.start].first] += block.end - block.start;
+
+		// Each worker takes the next block whenever it becomes free
+		std::atomic<std::size_t> nextBlock(0);
+		for (uint thread = 0; thread < threadNum; thread++) {
+			boost::asio::post(pool, [&]() {
+				for (std::size_t b = nextBlock++; b < blocks.size(); b = nextBlock++) {
+					TileBlock const &block = blocks[b];
+					for(std::size_t i = block.start; i < block.end; ++i) {
+						unsigned int zoom = tile_coordinates[i].first;
+						TileCoordinates coords = tile_coordinates[i].second;
+						outputProc(pool, sharedData, *osmStore, GetTileData(sources, coords, zoom), coords, zoom);
+					}
+					unsigned int blockZoom = tile_coordinates[block.start].first;
+					if ((tilesLeft[blockZoom] -= block.end - block.start) == 0) sharedData.simplifyCache.clearZoom(blockZoom);
+
+					const std::lock_guard<std::mutex> lock(io_mutex);
+					tc += (block.end - block.start);
+
+					unsigned int zoom = tile_coordinates[block.end - 1].first;
+					cout << "Zoom level " << zoom << ", writing tile " << tc << " of " << tile_coordinates.size() << "               \r" << std::flush;
+				}
 			});
 		}
 		
@@ -536,6 +614,8 @@ int main(int argc, char* argv[]) {
 
 	if (sqlite)
 		WriteSqliteMetadata(jsonConfig, sharedData, layers);
+	else if (pmtiles)
+		WritePMTilesMetadata(jsonConfig, sharedData, layers);
 	else 
 		WriteFileMetadata(jsonConfig, sharedData, layers);
 
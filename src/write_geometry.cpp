@@ -5,148 +5,121 @@ using namespace std;
 namespace geom = boost::geometry;
 extern bool verbose;
 
-WriteGeometryVisitor::WriteGeometryVisitor(const TileBbox *bp, vector_tile::Tile_Feature *fp, double sl) {
+WriteGeometryVisitor::WriteGeometryVisitor(const TileBbox *bp, MvtFeature *fp, double sl, SimplifyAlgorithm sa) {
 	bboxPtr = bp;
 	featurePtr = fp;
 	simplifyLevel = sl;
+	simplifyAlgorithm = sa;
+}
+
+template<class LineT>
+void WriteGeometryVisitor::scaleString(LineT const &points, XYString &scaledString) const {
+	scaledString.clear();
+	for (auto jt = points.begin(); jt != points.end(); ++jt) {
+		scaledString.push_back(bboxPtr->scaleLatpLon(jt->template get<1>(), jt->template get<0>()));
+	}
 }
 
 // Point
 void WriteGeometryVisitor::operator()(const Point &p) const {
 	if (geom::within(p, bboxPtr->clippingBox)) {
-		featurePtr->add_geometry(9);					// moveTo, repeat x1
+		featurePtr->addGeometry(9);					// moveTo, repeat x1
 		pair<int,int> xy = bboxPtr->scaleLatpLon(p.y(), p.x());
-		featurePtr->add_geometry((xy.first  << 1) ^ (xy.first  >> 31));
-		featurePtr->add_geometry((xy.second << 1) ^ (xy.second >> 31));
-		featurePtr->set_type(vector_tile::Tile_GeomType_POINT);
+		featurePtr->addGeometry((xy.first  << 1) ^ (xy.first  >> 31));
+		featurePtr->addGeometry((xy.second << 1) ^ (xy.second >> 31));
+		featurePtr->setType(vector_tile::Tile_GeomType_POINT);
 	}
 }
 
 // Multipolygon
 void WriteGeometryVisitor::operator()(const MultiPolygon &mp) const {
-	MultiPolygon current;
-	if (simplifyLevel>0) {
-		// Note that Boost simplify can sometimes produce invalid polygons, resulting in broken coastline etc.
-		// In that case, we just revert to the unsimplified version (at the cost of a larger geometry)
-		// See comments in https://github.com/boostorg/geometry/pull/460
-		// When/if dissolve is merged into Boost.Geometry, we can use that to fix the self-intersections
-		bool v = geom::is_valid(mp);
-		geom::simplify(mp, current, simplifyLevel);
-		if (v && !geom::is_valid(current)) { current=mp; }
-	} else {
-		current = mp;
-	}
-
 #if BOOST_VERSION >= 105800
 	geom::validity_failure_type failure;
-	if (verbose && !geom::is_valid(current, failure)) { cout << "Output multipolygon has " << boost_validity_error(failure) << endl; }
+	if (verbose && !geom::is_valid(mp, failure)) { cout << "Output multipolygon has " << boost_validity_error(failure) << endl; }
 #endif
 
+	// Simplify in tile co-ordinates (the tolerance in pixels). Rings which collapse are dropped,
+	// and rings which would intersect themselves are written unsimplified.
+	double tolerance = simplifyLevel / bboxPtr->xscale;
 	pair<int,int> lastPos(0,0);
-	for (MultiPolygon::const_iterator it = current.begin(); it != current.end(); ++it) {
-		XYString scaledString;
-		Ring ring = geom::exterior_ring(*it);
-		for (auto jt = ring.begin(); jt != ring.end(); ++jt) {
-			pair<int,int> xy = bboxPtr->scaleLatpLon(jt->get<1>(), jt->get<0>());
-			scaledString.push_back(xy);
-		}
+	XYString scaledString;
+	for (MultiPolygon::const_iterator it = mp.begin(); it != mp.end(); ++it) {
+		scaleString(geom::exterior_ring(*it), scaledString);
+		if (simplifyLevel>0 && !simplify::simplifyRing(scaledString, tolerance, simplifyAlgorithm)) continue;
 		bool success = writeDeltaString(&scaledString, featurePtr, &lastPos, true);
 		if (!success) continue;
 
-		InteriorRing interiors = geom::interior_rings(*it);
-		for (auto ii = interiors.begin(); ii != interiors.end(); ++ii) {
-			scaledString.clear();
-			XYString scaledInterior;
-			for (auto jt = ii->begin(); jt != ii->end(); ++jt) {
-				pair<int,int> xy = bboxPtr->scaleLatpLon(jt->get<1>(), jt->get<0>());
-				scaledString.push_back(xy);
-			}
+		for (auto const &inner: geom::interior_rings(*it)) {
+			scaleString(inner, scaledString);
+			if (simplifyLevel>0 && !simplify::simplifyRing(scaledString, tolerance, simplifyAlgorithm)) continue;
 			writeDeltaString(&scaledString, featurePtr, &lastPos, true);
 		}
 	}
-	featurePtr->set_type(vector_tile::Tile_GeomType_POLYGON);
+	featurePtr->setType(vector_tile::Tile_GeomType_POLYGON);
 }
 
 // Multilinestring
 void WriteGeometryVisitor::operator()(const MultiLinestring &mls) const {
-	MultiLinestring current;
-	if (simplifyLevel>0) {
-		geom::simplify(mls, current, simplifyLevel);
-	} else {
-		current = mls;
-	}
-
 	pair<int,int> lastPos(0,0);
-	for (MultiLinestring::const_iterator it = current.begin(); it != current.end(); ++it) {
-		XYString scaledString;
-		for (Linestring::const_iterator jt = it->begin(); jt != it->end(); ++jt) {
-			pair<int,int> xy = bboxPtr->scaleLatpLon(jt->get<1>(), jt->get<0>());
-			scaledString.push_back(xy);
-		}
+	XYString scaledString;
+	for (MultiLinestring::const_iterator it = mls.begin(); it != mls.end(); ++it) {
+		scaleString(*it, scaledString);
+		if (simplifyLevel>0) { simplify::simplifyLine(scaledString, simplifyLevel / bboxPtr->xscale, simplifyAlgorithm); }
 		writeDeltaString(&scaledString, featurePtr, &lastPos, false);
 	}
-	featurePtr->set_type(vector_tile::Tile_GeomType_LINESTRING);
+	featurePtr->setType(vector_tile::Tile_GeomType_LINESTRING);
 }
 
 // Linestring
 void WriteGeometryVisitor::operator()(const Linestring &ls) const { 
-	Linestring current;
-	if (simplifyLevel>0) {
-		geom::simplify(ls, current, simplifyLevel);
-	} else {
-		current = ls;
-	}
-
 	pair<int,int> lastPos(0,0);
 	XYString scaledString;
-	for (Linestring::const_iterator jt = current.begin(); jt != current.end(); ++jt) {
-		pair<int,int> xy = bboxPtr->scaleLatpLon(jt->get<1>(), jt->get<0>());
-		scaledString.push_back(xy);
-	}
+	scaleString(ls, scaledString);
+	if (simplifyLevel>0) { simplify::simplifyLine(scaledString, simplifyLevel / bboxPtr->xscale, simplifyAlgorithm); }
 	writeDeltaString(&scaledString, featurePtr, &lastPos, false);
-	featurePtr->set_type(vector_tile::Tile_GeomType_LINESTRING);
+	featurePtr->setType(vector_tile::Tile_GeomType_LINESTRING);
 }
 
 // Encode a series of pixel co-ordinates into the feature, using delta and zigzag encoding
-bool WriteGeometryVisitor::writeDeltaString(XYString *scaledString, vector_tile::Tile_Feature *featurePtr, pair<int,int> *lastPos, bool closePath) const {
+// (we count the points first, so that the lineTo command can be written before them)
+bool WriteGeometryVisitor::writeDeltaString(XYString *scaledString, MvtFeature *featurePtr, pair<int,int> *lastPos, bool closePath) const {
 	if (scaledString->size()<2) return false;
-	vector<uint32_t> geometry;
+	uint end=closePath ? scaledString->size()-1 : scaledString->size();
+	uint len=0;
+	pair<int,int> last = scaledString->at(0);
+	for (uint i=1; i<end; i++) {
+		if (scaledString->at(i) == last) { continue; }
+		last = scaledString->at(i);
+		len++;
+	}
+	if (closePath && len<2) return false;		// reject ABA polygons
+	if (len==0) return false;
 
 	// Start with a moveTo
 	int lastX = scaledString->at(0).first;
 	int lastY = scaledString->at(0).second;
 	int dx = lastX - lastPos->first;
 	int dy = lastY - lastPos->second;
-	geometry.push_back(9);						// moveTo, repeat x1
-	geometry.push_back((dx << 1) ^ (dx >> 31));
-	geometry.push_back((dy << 1) ^ (dy >> 31));
+	featurePtr->addGeometry(9);					// moveTo, repeat x1
+	featurePtr->addGeometry((dx << 1) ^ (dx >> 31));
+	featurePtr->addGeometry((dy << 1) ^ (dy >> 31));
 
 	// Then write out the line for each point
-	uint len=0;
-	geometry.push_back(0);						// this'll be our lineTo opcode, we set it later
-	uint end=closePath ? scaledString->size()-1 : scaledString->size();
+	featurePtr->addGeometry((len << 3) + 2);	// lineTo plus repeat
 	for (uint i=1; i<end; i++) {
 		int x = scaledString->at(i).first;
 		int y = scaledString->at(i).second;
 		if (x==lastX && y==lastY) { continue; }
 		dx = x-lastX;
 		dy = y-lastY;
-		geometry.push_back((dx << 1) ^ (dx >> 31));
-		geometry.push_back((dy << 1) ^ (dy >> 31));
+		featurePtr->addGeometry((dx << 1) ^ (dx >> 31));
+		featurePtr->addGeometry((dy << 1) ^ (dy >> 31));
 		lastX = x; lastY = y;
-		len++;
 	}
-	if (closePath && len<2) return false;		// reject ABA polygons
-	if (len==0) return false;
-	geometry[3] = (len << 3) + 2;				// lineTo plus repeat
 	if (closePath) {
-		geometry.push_back(7+8);				// closePath
+		featurePtr->addGeometry(7+8);			// closePath
 	}
-	for (uint i=0; i<geometry.size(); i++) { 
-		featurePtr->add_geometry(geometry[i]);
-	};
 	lastPos->first  = lastX;
 	lastPos->second = lastY;
 	return true;
 }
-
@@ -0,0 +1,80 @@
+/*
+	Tests for clip.h
+
+	The box clipping is checked against Boost's general intersection, on random star-shaped
+	polygons (some with holes) and their outlines as linestrings. (Boost's overlay rescales
+	coordinates for robustness, so its results only agree to about 1e-7.)
+*/
+
+#include "test.h"
+#include "clip.h"
+#include <random>
+
+namespace geom = boost::geometry;
+
+int main() {
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<double> u(0, 1);
+	unsigned clipped = 0;
+
+	for (unsigned i=0; i<20000; i++) {
+		// a random clockwise star around a centre near the box, maybe with a square hole
+		Polygon poly;
+		double cx = u(rng)*4-2, cy = u(rng)*4-2;
+		unsigned k = 3 + rng() % 20;
+		for (unsigned j=0; j<k; j++) {
+			double a = -2*M_PI*j/k, r = 0.5 + u(rng)*2;
+			poly.outer().push_back(Point(cx + r*cos(a), cy + r*sin(a)));
+		}
+		poly.outer().push_back(poly.outer().front());
+		if (rng() % 2) {
+			Ring hole;
+			for (unsigned j=0; j<4; j++) hole.push_back(Point(cx + 0.3*cos(M_PI*j/2), cy + 0.3*sin(M_PI*j/2)));
+			hole.push_back(hole.front());
+			poly.inners().push_back(hole);
+		}
+		geom::correct(poly);
+		if (!geom::is_valid(poly)) continue;
+
+		Box box(Point(-1 + u(rng)*0.5, -1 + u(rng)*0.5), Point(u(rng)*1.5, u(rng)*1.5));
+		Polygon boxPolygon;
+		geom::convert(box, boxPolygon);
+
+		// clipPolygon (with clipRing) gives the same area as a full intersection, and a valid result
+		MultiPolygon expected, result;
+		geom::intersection(poly, boxPolygon, expected);
+		if (clip::clipPolygon(poly, box, result)) {
+			clipped++;
+			CHECK(std::abs(geom::area(result) - geom::area(expected)) <= 1e-5 * (1 + std::abs(geom::area(expected))));
+			CHECK(result.empty() || geom::is_valid(result));
+		}
+
+		// clipRing alone, on an outer ring which crosses the box once
+		if (poly.inners().empty() && clip::ringPosition(poly.outer(), box) == clip::RingPosition::CROSSES_ONCE) {
+			Ring ring;
+			clip::clipRing(poly.outer(), box, ring);
+			MultiPolygon ringExpected;
+			Polygon outer;
+			outer.outer() = poly.outer();
+			geom::intersection(outer, boxPolygon, ringExpected);
+			CHECK(std::abs(std::abs(geom::area(ring)) - geom::area(ringExpected)) <= 1e-5 * (1 + geom::area(ringExpected)));
+		}
+
+		// clipLinestring gives the same length as a full intersection
+		Linestring ls(poly.outer().begin(), poly.outer().end());
+		MultiLinestring lsExpected, lsResult;
+		clip::clipLinestring(ls, box, lsResult);
+		geom::intersection(ls, box, lsExpected);
+		CHECK(std::abs(geom::length(lsResult) - geom::length(lsExpected)) <= 1e-5);
+
+		// coversBox agrees with covered_by whenever it gives an answer
+		clip::Coverage coverage = clip::coversBox(MultiPolygon{poly}, box);
+		if (coverage != clip::Coverage::UNKNOWN) {
+			CHECK((coverage == clip::Coverage::COVERS) == geom::covered_by(boxPolygon, poly));
+		}
+	}
+	// (most cases don't need the general fallback)
+	CHECK(clipped > 10000);
+
+	return TEST_RESULT;
+}
@@ -0,0 +1,45 @@
+/*
+	Tests for coordinates.h: tile Morton codes
+
+	tile_data.cpp relies on a tile's descendants having a contiguous range of codes, so we check
+	that as well as that the codes round-trip.
+*/
+
+#include "test.h"
+#include "coordinates.h"
+#include <random>
+
+int main() {
+	std::mt19937 rng(1);
+	for (unsigned i=0; i<100000; i++) {
+		TileCoordinate x = rng() & 0xFFFF, y = rng() & 0xFFFF;
+		uint64_t code = tile2morton(TileCoordinates(x, y));
+		TileCoordinates back = morton2tile(code);
+		CHECK(back.x == x && back.y == y);
+
+		// (x and y's bits interleave, x in the low bit)
+		CHECK((code & 1) == (x & 1) && ((code >> 1) & 1) == (y & 1));
+
+		// the parent's code is the code shifted down two bits...
+		TileCoordinates parent = morton2tile(code >> 2);
+		CHECK(parent.x == x/2 && parent.y == y/2);
+
+		// ...and the descendants of a tile n levels up are the codes (code << 2n) to ((code+1) << 2n)-1
+		unsigned n = 1 + rng() % 8;
+		uint64_t ancestor = tile2morton(TileCoordinates(x >> n, y >> n));
+		CHECK(code >= (ancestor << (2*n)) && code < ((ancestor+1) << (2*n)));
+	}
+
+	// codes follow the Z order within a 2x2 block
+	CHECK(tile2morton(TileCoordinates(0, 0)) == 0);
+	CHECK(tile2morton(TileCoordinates(1, 0)) == 1);
+	CHECK(tile2morton(TileCoordinates(0, 1)) == 2);
+	CHECK(tile2morton(TileCoordinates(1, 1)) == 3);
+
+	// the full range of tile coordinates
+	TileCoordinate last = ~TileCoordinate(0);
+	CHECK(morton2tile(tile2morton(TileCoordinates(last, last))) == TileCoordinates(last, last));
+	CHECK(morton2tile(tile2morton(TileCoordinates(last, 0))) == TileCoordinates(last, 0));
+
+	return TEST_RESULT;
+}
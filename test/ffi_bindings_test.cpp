@@ -0,0 +1,24 @@
+/*
+	Check that the Lua side of the LuaJIT FFI bindings compiles
+
+	It's only run in LuaJIT builds, so a mistake in it would otherwise only show up there. This
+	compiles it without running it (which would need require("ffi")), so works with any Lua.
+*/
+
+#include "test.h"
+#include "osm_lua_ffi.h"
+
+extern "C" {
+	#include "lua.h"
+	#include "lualib.h"
+	#include "lauxlib.h"
+}
+
+int main() {
+	lua_State *L = luaL_newstate();
+	int status = luaL_loadstring(L, ffiBindings);
+	if (status != 0) std::cerr << "ffiBindings: " << lua_tostring(L, -1) << std::endl;
+	CHECK(status == 0);
+	lua_close(L);
+	return TEST_RESULT;
+}
@@ -0,0 +1,108 @@
+/*
+	Tests for mvt_writer.h
+
+	MvtWriter must write exactly the bytes which building a vector_tile::Tile and serialising it
+	with protobuf would (as tilemaker used to). We build random tiles both ways and compare them.
+*/
+
+#include "test.h"
+#include "mvt_writer.h"
+#include <random>
+
+// A random value of any type
+static vector_tile::Tile_Value randomValue(std::mt19937 &rng) {
+	vector_tile::Tile_Value v;
+	switch (rng() % 7) {
+		case 0:  v.set_string_value("h\xc3\xa9llo" + std::to_string(rng())); break;
+		case 1:  v.set_float_value(rng() / 7.0f - 1e6); break;
+		case 2:  v.set_double_value(-(rng() / 3.0)); break;
+		case 3:  v.set_int_value(-int64_t(rng())); break;
+		case 4:  v.set_uint_value(rng()); break;
+		case 5:  v.set_sint_value(-int64_t(rng())); break;
+		default: v.set_bool_value(rng() % 2); break;
+	}
+	return v;
+}
+
+int main() {
+	std::mt19937 rng(1);
+	for (unsigned t=0; t<1000; t++) {
+		vector_tile::Tile tile;
+		MvtWriter writer;
+		writer.clear();
+
+		unsigned layers = rng() % 4;
+		for (unsigned l=0; l<layers; l++) {
+			vector_tile::Tile_Layer *layer = tile.add_layers();
+			writer.startLayer();
+
+			unsigned features = rng() % 5;
+			for (unsigned f=0; f<features; f++) {
+				vector_tile::Tile_Feature *feature = layer->add_features();
+				MvtFeature mvtFeature;
+				unsigned geometry = rng() % 10;
+				for (unsigned g=0; g<geometry; g++) {
+					uint32_t v = rng() % 3 == 0 ? uint32_t(rng()) : rng() % 300;		// (some need 5-byte varints)
+					feature->add_geometry(v);
+					mvtFeature.addGeometry(v);
+				}
+				unsigned tags = rng() % 6;
+				for (unsigned g=0; g<tags; g++) {
+					uint32_t v = rng() % 200;
+					feature->add_tags(v);
+					mvtFeature.addTag(v);
+				}
+				if (rng() % 2) {
+					feature->set_type(vector_tile::Tile_GeomType(rng() % 4));
+					mvtFeature.setType(feature->type());
+				}
+				if (rng() % 2) {
+					uint64_t id = rng() % 3 == 0 ? 0 : (uint64_t(rng()) << 32) | rng();
+					feature->set_id(id);
+					mvtFeature.setId(id);
+				}
+				// (features from a tile being merged with are added as protobuf messages)
+				if (rng() % 5 == 0) writer.addFeature(*feature);
+				else writer.addFeature(mvtFeature);
+			}
+
+			std::vector<std::string> keys;
+			std::vector<vector_tile::Tile_Value> values;
+			for (unsigned k=0, n=rng()%4; k<n; k++) {
+				keys.push_back(std::string(rng() % 200, 'a'+k));		// (some need 2-byte lengths)
+				layer->add_keys(keys.back());
+			}
+			for (unsigned k=0, n=rng()%6; k<n; k++) {
+				values.push_back(randomValue(rng));
+				*layer->add_values() = values.back();
+			}
+
+			std::string name = "layer" + std::to_string(l);
+			writer.endLayer(name, 2, 4096, keys, values);
+			// (layers without features aren't written)
+			if (layer->features_size() == 0) {
+				tile.mutable_layers()->RemoveLast();
+				continue;
+			}
+			layer->set_name(name);
+			layer->set_version(2);
+			layer->set_extent(4096);
+		}
+
+		// a layer from a tile being merged with
+		if (rng() % 4 == 0) {
+			vector_tile::Tile_Layer *layer = tile.add_layers();
+			layer->set_name("existing");
+			layer->set_version(1);
+			layer->add_keys("key");
+			layer->add_features()->add_geometry(9);
+			writer.addLayer(*layer);
+		}
+
+		std::string expected;
+		tile.SerializeToString(&expected);
+		CHECK(writer.data() == expected);
+	}
+
+	return TEST_RESULT;
+}
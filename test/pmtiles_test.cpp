@@ -0,0 +1,48 @@
+/*
+	Tests for PMTiles tile IDs
+
+	Checked against the examples in the PMTiles version 3 specification and reference
+	implementations, and for the Hilbert curve's properties: at each zoom, the IDs follow on from
+	the lower zooms without gaps, and tiles with consecutive IDs are next to each other.
+*/
+
+#include "test.h"
+#include "pmtiles.h"
+#include <vector>
+#include <cstdlib>
+
+int main() {
+	CHECK(PMTiles::zxyToTileID(0, 0, 0) == 0);
+	CHECK(PMTiles::zxyToTileID(1, 0, 0) == 1);
+	CHECK(PMTiles::zxyToTileID(1, 0, 1) == 2);
+	CHECK(PMTiles::zxyToTileID(1, 1, 1) == 3);
+	CHECK(PMTiles::zxyToTileID(1, 1, 0) == 4);
+	CHECK(PMTiles::zxyToTileID(2, 0, 0) == 5);
+	CHECK(PMTiles::zxyToTileID(12, 3423, 1763) == 19078479);
+
+	for (uint8_t zoom = 0; zoom <= 8; zoom++) {
+		uint32_t size = 1u << zoom;
+		uint64_t first = ((uint64_t(1) << (2*zoom)) - 1) / 3;
+		std::vector<std::pair<uint32_t,uint32_t>> tiles(uint64_t(size) * size, std::make_pair(size, size));
+		for (uint32_t x = 0; x < size; x++) {
+			for (uint32_t y = 0; y < size; y++) {
+				uint64_t id = PMTiles::zxyToTileID(zoom, x, y);
+				CHECK(id >= first && id < first + tiles.size());
+				if (id < first || id >= first + tiles.size()) continue;
+				CHECK(tiles[id - first].first == size);			// not already used
+				tiles[id - first] = std::make_pair(x, y);
+			}
+		}
+		for (size_t i = 1; i < tiles.size(); i++) {
+			int dx = std::abs(int(tiles[i].first) - int(tiles[i-1].first));
+			int dy = std::abs(int(tiles[i].second) - int(tiles[i-1].second));
+			CHECK(dx + dy == 1);
+		}
+	}
+
+	// the last tile at the deepest zoom PMTiles allows
+	CHECK(PMTiles::zxyToTileID(26, 0, 0) == ((uint64_t(1) << 52) - 1) / 3);
+	CHECK(PMTiles::zxyToTileID(26, (1u << 26) - 1, 0) == ((uint64_t(1) << 54) - 1) / 3 - 1);
+
+	return TEST_RESULT;
+}
@@ -0,0 +1,79 @@
+/*
+	Tests for simplify.h
+
+	simplifyRing promises that a simple ring stays simple: either the simplified ring is simple, or
+	the ring is left as it was (or dropped, if it collapses). We check that for both algorithms on
+	random wobbly rings, whose simplification would often cross itself, and check isSimpleRing
+	against Boost's validity test.
+*/
+
+#include "test.h"
+#include "simplify.h"
+#include <random>
+
+namespace geom = boost::geometry;
+
+typedef std::vector<std::pair<int,int>> PixelRing;
+
+// Is the ring a valid polygon outer (in either winding)?
+static bool validRing(PixelRing const &ring) {
+	Polygon p;
+	for (auto const &pt: ring) p.outer().push_back(Point(pt.first, pt.second));
+	if (geom::is_valid(p)) return true;
+	std::reverse(p.outer().begin(), p.outer().end());
+	return geom::is_valid(p);
+}
+
+int main() {
+	std::mt19937 rng(3);
+	std::uniform_real_distribution<double> wobble(0.5, 1.0);
+	unsigned simplified = 0;
+
+	for (unsigned i=0; i<2000; i++) {
+		// a star-shaped ring around the centre of a tile, whose radius varies randomly
+		PixelRing ring;
+		unsigned n = 50 + rng() % 2000;
+		for (unsigned j=0; j<n; j++) {
+			double a = 2*M_PI*j/n;
+			double r = 1500 * wobble(rng) * (1 + 0.3*sin(7*a));
+			ring.emplace_back(2048 + int(r*cos(a)), 2048 + int(r*sin(a)));
+		}
+		ring.push_back(ring.front());
+		simplify::removeRepeated(ring);
+
+		bool simple = validRing(ring);
+		CHECK(simplify::isSimpleRing(ring) == simple);
+		if (!simple) continue;
+
+		for (auto algorithm: { SimplifyAlgorithm::DOUGLAS_PEUCKER, SimplifyAlgorithm::VISVALINGAM }) {
+			PixelRing result = ring;
+			if (!simplify::simplifyRing(result, 8.0, algorithm)) continue;
+			CHECK(validRing(result));
+			CHECK(result.front() == result.back());
+			if (result.size() < ring.size()) simplified++;
+		}
+	}
+	// (and it does actually simplify them)
+	CHECK(simplified > 1000);
+
+	// isSimpleRing on some small cases
+	CHECK( simplify::isSimpleRing(PixelRing{ {0,0}, {0,10}, {10,10}, {10,0}, {0,0} }));
+	CHECK(!simplify::isSimpleRing(PixelRing{ {0,0}, {10,10}, {10,0}, {0,10}, {0,0} }));					// bow tie
+	CHECK(!simplify::isSimpleRing(PixelRing{ {0,0}, {0,10}, {10,10}, {10,5}, {20,5}, {10,5}, {10,0}, {0,0} }));	// spike
+	CHECK(!simplify::isSimpleRing(PixelRing{ {0,0}, {0,10}, {5,5}, {10,10}, {10,0}, {5,5}, {0,0} }));		// touches itself
+
+	// a ring which collapses is dropped
+	PixelRing thin { {0,0}, {0,1000}, {1,1000}, {1,0}, {0,0} };
+	CHECK(!simplify::simplifyRing(thin, 8.0, SimplifyAlgorithm::DOUGLAS_PEUCKER));
+
+	// lines keep their ends, and Douglas-Peucker keeps every point within the tolerance
+	Linestring line;
+	for (unsigned i=0; i<1000; i++) line.push_back(Point(i*0.01, sin(i*0.05)));
+	Linestring original = line;
+	simplify::simplifyLine(line, 0.01, SimplifyAlgorithm::DOUGLAS_PEUCKER);
+	CHECK(line.size() < original.size() / 4);
+	CHECK(geom::equals(line.front(), original.front()) && geom::equals(line.back(), original.back()));
+	for (auto const &p: original) CHECK(geom::distance(p, line) <= 0.01 + 1e-9);
+
+	return TEST_RESULT;
+}
@@ -0,0 +1,25 @@
+/*! \file */
+#ifndef _TEST_H
+#define _TEST_H
+
+#include <iostream>
+#include <cstdlib>
+
+/*	Minimal test support
+
+	Each test is a program which returns 0 if all its checks pass. CHECK reports each failure
+	(and carries on, so one run shows them all); TEST_RESULT is what main returns.
+*/
+
+static unsigned testFailures = 0;
+
+#define CHECK(condition) do { \
+	if (!(condition)) { \
+		std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+		testFailures++; \
+	} \
+} while (0)
+
+#define TEST_RESULT (testFailures == 0 ? EXIT_SUCCESS : EXIT_FAILURE)
+
+#endif //_TEST_H